@@ -140,7 +140,7 @@ int main() {
     void* ptr3 = srealloc(ptr2, 100);
             REQUIRE(ptr3 != nullptr);
             REQUIRE(ptr2 == ptr3);
-    verify_block_by_order(0,0,0,0,1,1,1,0,1,0,1,0,1,0,1,0,1,0,1,0,31,0,0,0);
+    verify_block_by_order(1,1,1,0,1,0,1,0,1,0,1,0,1,0,1,0,1,0,1,0,31,0,0,0);
 
 
     void* ptr4 = srealloc(ptr3, 128*pow(2,8) -64);
@@ -0,0 +1,68 @@
+#include "altmain.h"
+#include <unistd.h>
+
+/*
+ * Checks for malloc_2's block splitting, coalescing and wilderness extension.
+ * Build: g++ -std=c++17 -DDEBUG malloc_2.cpp altmain_2.cpp
+ * Nothing here may call into libc's malloc before the checks are done, since it shares the program break with us.
+ */
+
+void split_and_coalesce() {
+    const size_t meta = _size_meta_data();
+
+    void* big = smalloc(1000);
+    REQUIRE(big != nullptr);
+    verify_blocks(1, 1000, 0, 0);
+    sfree(big);
+    verify_blocks(1, 1000, 1, 1000);
+
+    //Reusing the free block for 100 bytes (rounded up to 104 to keep the next header aligned) splits off the rest:
+    void* small = smalloc(100);
+    REQUIRE(small == big);
+    verify_blocks(2, 104 + (1000 - 104 - meta), 1, 1000 - 104 - meta);
+
+    //Freeing it coalesces it with the free remainder on its right:
+    sfree(small);
+    verify_blocks(1, 1000, 1, 1000);
+
+    //A remainder that couldn't hold MIN_SPLIT_REMAINDER (128) bytes is left in the block instead:
+    void* almost = smalloc(1000 - meta - 100);
+    REQUIRE(almost == big);
+    verify_blocks(1, 1000, 0, 0);
+
+    //A freed block also coalesces with a free block on its left:
+    void* after = smalloc(200);
+    REQUIRE(after == (char*)almost + 1000 + meta);
+    verify_blocks(2, 1200, 0, 0);
+    sfree(almost);
+    verify_blocks(2, 1200, 1, 1000);
+    sfree(after);
+    verify_blocks(1, 1200 + meta, 1, 1200 + meta);
+}
+
+//Expects the last block to be a free one of 1200 + meta bytes, as split_and_coalesce leaves it.
+void wilderness_extension() {
+    const size_t meta = _size_meta_data();
+    const size_t wilderness = 1200 + meta;
+
+    //Nothing free fits 2000 bytes, so the free last block grows by just the shortfall, with no new block:
+    void* before = sbrk(0);
+    void* grown = smalloc(2000);
+    REQUIRE(grown != nullptr);
+    REQUIRE((size_t)((char*)sbrk(0) - (char*)before) == 2000 - wilderness);
+    verify_blocks(1, 2000, 0, 0);
+
+    //srealloc grows an allocated last block the same way:
+    before = sbrk(0);
+    REQUIRE(srealloc(grown, 3000) == grown);
+    REQUIRE((size_t)((char*)sbrk(0) - (char*)before) == 1000);
+    verify_blocks(1, 3000, 0, 0);
+    sfree(grown);
+}
+
+int main() {
+    split_and_coalesce();
+    wilderness_extension();
+    std::cout << "malloc_2 checks passed." << std::endl;
+    return 0;
+}
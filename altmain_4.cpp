@@ -0,0 +1,453 @@
+#include "altmain.h"
+#include <fstream>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+/*
+ * Single-threaded checks for malloc_4, each run in a forked child so that it starts from a fresh allocator.
+ * Build: g++ -std=c++17 -DDEBUG malloc_4.cpp altmain_4.cpp -lpthread
+ */
+
+size_t _num_hugetlb_mappings();
+size_t _num_thp_mappings();
+size_t _num_cached_mapping_bytes();
+size_t _num_released_bytes();
+void _set_mapping_cache(size_t max_bytes, unsigned long decay_ms);
+void _set_free_block_release(int advice);
+void _set_zero_pool(int blocks_per_order);
+size_t _num_zero_pool_hits();
+size_t _num_zero_pool_misses();
+void _set_hugepage_heap(bool enabled);
+
+const size_t KiB = 1024;
+const size_t MiB = 1024 * 1024;
+const size_t HUGEPAGE = 2 * MiB;
+const int MAX_ORDER_BLOCKS = 32; //In the first heap extent.
+const size_t MAX_ORDER_PAYLOAD = 128 * KiB - 32; //Anything from 128 KiB - 16 up is memory mapped instead.
+
+//The Size, AnonHugePages and KernelPageSize lines (in kB) and the VmFlags of the /proc/self/smaps entry covering address.
+struct Vma {
+    size_t size_kb = 0;
+    size_t anon_hugepages_kb = 0;
+    size_t kernel_page_kb = 0;
+    std::string flags;
+};
+
+Vma find_vma(const void* address) {
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    bool inside = false;
+    Vma vma;
+    while (std::getline(smaps, line)) {
+        unsigned long start, end;
+        if (std::sscanf(line.c_str(), "%lx-%lx ", &start, &end) == 2 && line.find(':') > line.find(' ')) {
+            if (inside) {
+                break;
+            }
+            inside = start <= (unsigned long)address && (unsigned long)address < end;
+            continue;
+        }
+        if (inside) {
+            std::sscanf(line.c_str(), "Size: %zu kB", &vma.size_kb);
+            std::sscanf(line.c_str(), "AnonHugePages: %zu kB", &vma.anon_hugepages_kb);
+            std::sscanf(line.c_str(), "KernelPageSize: %zu kB", &vma.kernel_page_kb);
+            if (line.rfind("VmFlags:", 0) == 0) {
+                vma.flags = line.substr(8) + " ";
+            }
+        }
+    }
+    return vma;
+}
+
+bool transparent_hugepages_available() {
+    std::ifstream enabled("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string modes;
+    std::getline(enabled, modes);
+    return modes.find("[never]") == std::string::npos && !modes.empty();
+}
+
+size_t free_hugetlb_pages() {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    size_t pages = 0;
+    while (std::getline(meminfo, line)) {
+        std::sscanf(line.c_str(), "HugePages_Free: %zu", &pages);
+    }
+    return pages;
+}
+
+//A 4 MiB request is hugepage backed, and takes exactly two hugepages: the header doesn't spill into a third.
+void hugepage_mapping() {
+    auto hugepage_mappings = _num_hugetlb_mappings() + _num_thp_mappings();
+    auto payload = (char*)smalloc(4 * 1024 * 1024);
+    REQUIRE(payload != nullptr);
+    REQUIRE((uintptr_t)payload % HUGEPAGE == 0);
+    REQUIRE(_num_hugetlb_mappings() + _num_thp_mappings() == hugepage_mappings + 1);
+    std::memset(payload, 1, 4 * 1024 * 1024);
+    auto vma = find_vma(payload);
+    REQUIRE(vma.size_kb == 4096);
+    if (vma.kernel_page_kb == 2048) {
+        REQUIRE(_num_hugetlb_mappings() == 1);
+    }
+    else if (transparent_hugepages_available()) {
+        REQUIRE(vma.anon_hugepages_kb == 4096);
+    }
+    sfree(payload);
+
+    //Just below the threshold it's a regular mapping:
+    payload = (char*)smalloc(4 * 1024 * 1024 - 1);
+    REQUIRE(payload != nullptr);
+    REQUIRE(_num_hugetlb_mappings() + _num_thp_mappings() == hugepage_mappings + 1);
+    sfree(payload);
+}
+
+//Freed mappings are cached at the length actually mapped, and handed out again at that length.
+void mapping_cache() {
+    //The smallest mapped block takes exactly 32 pages:
+    auto payload = smalloc(128 * KiB - _size_meta_data());
+    REQUIRE(payload != nullptr);
+    sfree(payload);
+    REQUIRE(_num_cached_mapping_bytes() == 128 * KiB);
+    auto reused = (char*)smalloc(128 * KiB - _size_meta_data());
+    REQUIRE(reused == payload);
+    REQUIRE(_num_cached_mapping_bytes() == 0);
+    std::memset(reused, 1, 128 * KiB - _size_meta_data());
+    sfree(reused);
+
+    //One byte past 4 MiB takes a third hugepage, and all three can be reused:
+    payload = smalloc(4 * MiB + 1);
+    REQUIRE(payload != nullptr);
+    sfree(payload);
+    REQUIRE(_num_cached_mapping_bytes() == 128 * KiB + 6 * MiB);
+    reused = (char*)smalloc(6 * MiB - 64 * KiB);
+    REQUIRE(reused == payload);
+    std::memset(reused, 1, 6 * MiB - 64 * KiB);
+    sfree(reused);
+    REQUIRE(_num_cached_mapping_bytes() == 128 * KiB + 6 * MiB);
+
+    //A cached mapping longer than the request keeps its whole length when it's freed again:
+    payload = smalloc(10 * MiB);
+    sfree(payload);
+    reused = (char*)smalloc(7 * MiB);
+    REQUIRE(reused == payload);
+    std::memset(reused, 1, 7 * MiB);
+    sfree(reused);
+    REQUIRE(_num_cached_mapping_bytes() == 128 * KiB + 16 * MiB);
+
+    //Without the cache, freeing unmaps exactly what was mapped:
+    _set_mapping_cache(0, 1000);
+    REQUIRE(_num_cached_mapping_bytes() == 0);
+    payload = smalloc(4 * MiB + 1);
+    REQUIRE(payload != nullptr);
+    sfree(payload);
+    payload = smalloc(4 * MiB + 1);
+    REQUIRE(payload != nullptr);
+    std::memset(payload, 1, 4 * MiB + 1);
+    sfree(payload);
+}
+
+void fill(unsigned char* payload, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        payload[i] = (unsigned char)(i % 251);
+    }
+}
+
+bool filled(const unsigned char* payload, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (payload[i] != (unsigned char)(i % 251)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * srealloc moves memory mapped blocks' page tables with mremap rather than copying them into a new mapping, so the
+ * data stays and nothing goes through the mapping cache. Shrinking, or growing within the mapped pages, keeps the
+ * address too.
+ */
+void srealloc_remap() {
+    auto payload = (unsigned char*)smalloc(300 * KiB - 1000);
+    REQUIRE(payload != nullptr);
+    fill(payload, 300 * KiB - 1000);
+    REQUIRE(srealloc(payload, 300 * KiB) == payload);
+    REQUIRE(filled(payload, 300 * KiB - 1000));
+    fill(payload, 300 * KiB);
+    auto heap_bytes = _num_allocated_bytes() - 300 * KiB; //Free heap blocks count as allocated too.
+
+    auto grown = (unsigned char*)srealloc(payload, 3 * MiB);
+    REQUIRE(grown != nullptr);
+    REQUIRE(filled(grown, 300 * KiB));
+    REQUIRE(_num_allocated_bytes() == heap_bytes + 3 * MiB);
+    REQUIRE(_num_cached_mapping_bytes() == 0);
+    fill(grown, 3 * MiB);
+
+    auto shrunk = (unsigned char*)srealloc(grown, 200 * KiB);
+    REQUIRE(shrunk == grown);
+    REQUIRE(filled(shrunk, 200 * KiB));
+    REQUIRE(_num_allocated_bytes() == heap_bytes + 200 * KiB);
+    REQUIRE(_num_cached_mapping_bytes() == 0);
+
+    //Turning into a hugepage block takes a new mapping after all, still with the data:
+    auto hugepage = (unsigned char*)srealloc(shrunk, 4 * MiB);
+    REQUIRE(hugepage != nullptr);
+    REQUIRE((uintptr_t)hugepage % HUGEPAGE == 0);
+    REQUIRE(filled(hugepage, 200 * KiB));
+    REQUIRE(_num_cached_mapping_bytes() == 200 * KiB);
+    sfree(hugepage);
+}
+
+/*
+ * Once more than 8 free max-order blocks are resident, all but 2 get released, keeping only their first page. Released
+ * blocks are still free blocks, and are taken (and no longer counted as released) after the resident ones.
+ */
+void release_watermarks(int advice) {
+    const size_t released_block = 128 * KiB - sysconf(_SC_PAGESIZE);
+    _set_free_block_release(advice);
+    auto small = smalloc(100);
+    REQUIRE(small != nullptr);
+    REQUIRE(_num_released_bytes() == 0);
+    sfree(small);
+    REQUIRE(_num_released_bytes() == (MAX_ORDER_BLOCKS - 2) * released_block);
+    verify_blocks(MAX_ORDER_BLOCKS, MAX_ORDER_BLOCKS * (128 * KiB - _size_meta_data()),
+                  MAX_ORDER_BLOCKS, MAX_ORDER_BLOCKS * (128 * KiB - _size_meta_data()));
+
+    void* blocks[9];
+    for (auto& block : blocks) {
+        block = smalloc(MAX_ORDER_PAYLOAD);
+        REQUIRE(block != nullptr);
+        std::memset(block, 0xff, MAX_ORDER_PAYLOAD);
+    }
+    REQUIRE(_num_released_bytes() == (MAX_ORDER_BLOCKS - 9) * released_block);
+    //Eight resident free blocks is still at the high watermark:
+    for (int i = 0; i < 8; ++i) {
+        sfree(blocks[i]);
+    }
+    REQUIRE(_num_released_bytes() == (MAX_ORDER_BLOCKS - 9) * released_block);
+
+    //A ninth is past it:
+    sfree(blocks[8]);
+    REQUIRE(_num_released_bytes() == (MAX_ORDER_BLOCKS - 2) * released_block);
+    verify_blocks(MAX_ORDER_BLOCKS, MAX_ORDER_BLOCKS * (128 * KiB - _size_meta_data()),
+                  MAX_ORDER_BLOCKS, MAX_ORDER_BLOCKS * (128 * KiB - _size_meta_data()));
+}
+
+//scalloc rejects counts whose total size overflows, rather than allocating the wrapped-around size.
+void scalloc_arguments() {
+    REQUIRE(scalloc(0x100000001, 16) == nullptr);
+    REQUIRE(scalloc(16, 0x100000001) == nullptr);
+    REQUIRE(scalloc((size_t)-1, 2) == nullptr);
+    REQUIRE(scalloc(0, 16) == nullptr);
+    REQUIRE(scalloc(16, 0) == nullptr);
+    auto payload = (unsigned char*)scalloc(3, 5);
+    REQUIRE(payload != nullptr);
+    for (int i = 0; i < 15; ++i) {
+        REQUIRE(payload[i] == 0);
+    }
+    sfree(payload);
+}
+
+bool all_zero(const void* payload, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (((const unsigned char*)payload)[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//Fills every max-order block of the first extent with ones and frees them again, so no free block is known to be zero.
+void dirty_heap() {
+    void* blocks[MAX_ORDER_BLOCKS];
+    for (auto& block : blocks) {
+        block = smalloc(MAX_ORDER_PAYLOAD);
+        REQUIRE(block != nullptr);
+        std::memset(block, 0xff, MAX_ORDER_PAYLOAD);
+    }
+    for (auto block : blocks) {
+        sfree(block);
+    }
+}
+
+//Takes every max-order block of the first extent with scalloc, checking each reads as zero. Returns whether
+//one of them was the block at at.
+bool scalloc_heap(const void* at = nullptr) {
+    void* blocks[MAX_ORDER_BLOCKS];
+    bool found = false;
+    for (auto& block : blocks) {
+        block = scalloc(1, MAX_ORDER_PAYLOAD);
+        REQUIRE(block != nullptr);
+        REQUIRE(all_zero(block, MAX_ORDER_PAYLOAD));
+        found = found || block == at;
+    }
+    for (auto block : blocks) {
+        sfree(block);
+    }
+    return found;
+}
+
+//Memory scalloc skips clearing, because the kernel just handed it over, does read as zero.
+void scalloc_fresh_memory() {
+    auto small = scalloc(10, 100);
+    REQUIRE(small != nullptr);
+    REQUIRE(all_zero(small, 1000));
+    auto mapped = scalloc(1, 200 * KiB);
+    REQUIRE(mapped != nullptr);
+    REQUIRE(all_zero(mapped, 200 * KiB));
+    sfree(mapped);
+    sfree(small);
+    scalloc_heap();
+}
+
+//Reused blocks and cached mappings that were written to do get cleared.
+void scalloc_dirty_memory() {
+    dirty_heap();
+    scalloc_heap();
+    auto small = scalloc(10, 100);
+    REQUIRE(small != nullptr);
+    REQUIRE(all_zero(small, 1000));
+    sfree(small);
+
+    auto mapped = smalloc(200 * KiB);
+    REQUIRE(mapped != nullptr);
+    std::memset(mapped, 0xff, 200 * KiB);
+    sfree(mapped);
+    auto reused = scalloc(200, KiB);
+    REQUIRE(reused == mapped);
+    REQUIRE(all_zero(reused, 200 * KiB));
+    sfree(reused);
+}
+
+//A dirty block released with MADV_DONTNEED reads as zero afterwards, the first page's leftovers included.
+void scalloc_released_memory() {
+    _set_free_block_release(MADV_DONTNEED);
+    auto dirty = smalloc(MAX_ORDER_PAYLOAD);
+    REQUIRE(dirty != nullptr);
+    std::memset(dirty, 0xff, MAX_ORDER_PAYLOAD);
+    sfree(dirty);
+    REQUIRE(scalloc_heap(dirty));
+}
+
+//Blocks the zero pool cleared in the background read as zero.
+void scalloc_zero_pool_memory() {
+    dirty_heap();
+    _set_zero_pool(4);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    scalloc_heap();
+    auto small = scalloc(10, 100);
+    REQUIRE(small != nullptr);
+    REQUIRE(all_zero(small, 1000));
+    sfree(small);
+    _set_zero_pool(0);
+}
+
+//Without reserved hugetlbfs pages, hugepage mappings fall back to transparent hugepages, and are counted as such.
+void hugepage_fallback() {
+    bool reserved = free_hugetlb_pages() >= 8;
+    _set_hugepage_heap(true);
+    auto small = smalloc(100);
+    REQUIRE(small != nullptr);
+    REQUIRE(_num_hugetlb_mappings() + _num_thp_mappings() == 1);
+    if (!reserved) {
+        REQUIRE(_num_hugetlb_mappings() == 0);
+        REQUIRE(_num_thp_mappings() == 1);
+        REQUIRE(find_vma(small).flags.find(" hg ") != std::string::npos); //Asked for with MADV_HUGEPAGE.
+    }
+
+    auto large = smalloc(4 * MiB);
+    REQUIRE(large != nullptr);
+    REQUIRE(_num_hugetlb_mappings() + _num_thp_mappings() == 2);
+    if (!reserved) {
+        REQUIRE(_num_thp_mappings() == 2);
+        REQUIRE(find_vma(large).flags.find(" hg ") != std::string::npos);
+    }
+
+    //scalloc goes by the element size, which has to be larger than 2 MiB:
+    auto elements = scalloc(2, 2 * MiB);
+    REQUIRE(elements != nullptr);
+    REQUIRE(_num_hugetlb_mappings() + _num_thp_mappings() == 2);
+    auto element = scalloc(1, 2 * MiB + 1);
+    REQUIRE(element != nullptr);
+    REQUIRE(_num_hugetlb_mappings() + _num_thp_mappings() == 3);
+    REQUIRE((uintptr_t)element % HUGEPAGE == 0);
+
+    sfree(element);
+    sfree(elements);
+    sfree(large);
+    sfree(small);
+}
+
+//scalloc counts a hit for a block the zero pool cleared, and a miss for any other one it gets while the pool is on.
+void zero_pool_hits() {
+    auto before_pool = scalloc(10, 100);
+    REQUIRE(before_pool != nullptr);
+    sfree(before_pool);
+    dirty_heap();
+    REQUIRE(_num_zero_pool_hits() == 0 && _num_zero_pool_misses() == 0);
+
+    _set_zero_pool(4);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    //Small requests can split one of the max-order blocks the pool cleared:
+    auto small = scalloc(10, 100);
+    REQUIRE(small != nullptr);
+    REQUIRE(_num_zero_pool_hits() == 1 && _num_zero_pool_misses() == 0);
+
+    //The other three the pool cleared are hits, and the dirty ones misses (unless the pool got to them meanwhile):
+    void* blocks[MAX_ORDER_BLOCKS - 1];
+    for (auto& block : blocks) {
+        block = scalloc(1, MAX_ORDER_PAYLOAD);
+        REQUIRE(block != nullptr);
+    }
+    REQUIRE(_num_zero_pool_hits() >= 4);
+    REQUIRE(_num_zero_pool_hits() + _num_zero_pool_misses() == MAX_ORDER_BLOCKS);
+
+    //A fresh heap extent is zero too, but not thanks to the pool:
+    auto hits = _num_zero_pool_hits();
+    auto fresh = scalloc(1, MAX_ORDER_PAYLOAD);
+    REQUIRE(fresh != nullptr);
+    REQUIRE(_num_zero_pool_hits() == hits);
+    REQUIRE(_num_zero_pool_hits() + _num_zero_pool_misses() == MAX_ORDER_BLOCKS + 1);
+
+    _set_zero_pool(0);
+    sfree(fresh);
+    for (auto block : blocks) {
+        sfree(block);
+    }
+    sfree(small);
+}
+
+template <typename Check>
+bool run_in_child(const char* name, Check check) {
+    auto pid = fork();
+    if (pid == 0) {
+        check();
+        exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    bool passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    std::cout << name << ": " << (passed ? "passed" : "!!!!!!!!!!!!!!!!!!!!!!failed!!!!!!!!!!!!!!!!!!!!!!") << "."
+              << std::endl;
+    return passed;
+}
+
+int main() {
+    bool passed = true;
+    passed &= run_in_child("hugepage mapping", hugepage_mapping);
+    passed &= run_in_child("hugepage fallback", hugepage_fallback);
+    passed &= run_in_child("mapping cache", mapping_cache);
+    passed &= run_in_child("srealloc remap", srealloc_remap);
+    passed &= run_in_child("release watermarks with MADV_DONTNEED", [] { release_watermarks(MADV_DONTNEED); });
+    passed &= run_in_child("release watermarks with MADV_FREE", [] { release_watermarks(MADV_FREE); });
+    passed &= run_in_child("scalloc arguments", scalloc_arguments);
+    passed &= run_in_child("scalloc on fresh memory", scalloc_fresh_memory);
+    passed &= run_in_child("scalloc on dirty memory", scalloc_dirty_memory);
+    passed &= run_in_child("scalloc on released memory", scalloc_released_memory);
+    passed &= run_in_child("scalloc on zero pool memory", scalloc_zero_pool_memory);
+    passed &= run_in_child("zero pool hits", zero_pool_hits);
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+#include "altmain.h"
+#include <thread>
+#include <atomic>
+#include <random>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+ * Multithreaded checks for malloc_4, run once per setup of its optional thread-scaling features. Each run starts from a
+ * fresh allocator in a forked child. Build: g++ -std=c++17 -DDEBUG malloc_4.cpp altmain_mt.cpp -lpthread
+ */
+
+void _set_thread_cache_limit(int order, int max_blocks);
+void _flush_thread_cache();
+void _set_thread_cache_stealing(bool enabled);
+size_t _num_stolen_batches();
+void _set_arenas(int count, bool by_cpu);
+void _set_cpu_cache_limit(int max_blocks);
+void _flush_cpu_caches();
+void _set_remote_free_queues(bool enabled);
+size_t _num_remote_free_blocks();
+void _drain_remote_frees();
+void _set_lock_free_stacks(int max_blocks);
+void _drain_lock_free_stacks();
+
+const int THREAD_COUNT = 8;
+const int OPERATIONS = 10000;
+const int HANDOFF_SLOTS = 64;
+
+struct Allocation {
+    unsigned char* payload;
+    size_t size;
+    unsigned char tag;
+};
+
+//Blocks handed from one thread to another, so that plenty of them are freed by a thread that didn't allocate them.
+std::atomic<Allocation*> handoffs[HANDOFF_SLOTS];
+
+void verify_payload(const Allocation& allocation) {
+    for (size_t i = 0; i < allocation.size; i += 61) {
+        REQUIRE(allocation.payload[i] == allocation.tag);
+    }
+}
+
+//Every thread sticks to a few size classes of its own, plus the odd memory mapped block.
+void worker(int index) {
+    std::mt19937 random(index * 7919 + 1);
+    std::vector<Allocation> live;
+    for (int i = 0; i < OPERATIONS; ++i) {
+        int operation = random() % 10;
+        if (operation < 4 || live.empty()) {
+            size_t size = random() % 50 == 0 ? random() % 400000 + 1 : random() % (128 << (index % 6)) + 1;
+            bool zeroed = random() % 3 == 0;
+            auto payload = (unsigned char*)(zeroed ? scalloc(size, 1) : smalloc(size));
+            REQUIRE(payload != nullptr);
+            for (size_t j = 0; zeroed && j < size; ++j) {
+                REQUIRE(payload[j] == 0);
+            }
+            auto tag = (unsigned char)random();
+            std::memset(payload, tag, size);
+            live.push_back({payload, size, tag});
+        }
+        else if (operation < 7) {
+            size_t k = random() % live.size();
+            verify_payload(live[k]);
+            sfree(live[k].payload);
+            live[k] = live.back();
+            live.pop_back();
+        }
+        else if (operation < 8) {
+            size_t k = random() % live.size();
+            auto handed = handoffs[random() % HANDOFF_SLOTS].exchange(new Allocation(live[k]));
+            live[k] = live.back();
+            live.pop_back();
+            if (handed) {
+                verify_payload(*handed);
+                live.push_back(*handed);
+                delete handed;
+            }
+        }
+        else {
+            auto& allocation = live[random() % live.size()];
+            size_t size = allocation.size > 128 * 1024 ? random() % 500000 + 1 : random() % 20000 + 1;
+            auto payload = (unsigned char*)srealloc(allocation.payload, size);
+            REQUIRE(payload != nullptr);
+            for (size_t j = 0; j < size && j < allocation.size; j += 17) {
+                REQUIRE(payload[j] == allocation.tag);
+            }
+            std::memset(payload, allocation.tag, size);
+            allocation.payload = payload;
+            allocation.size = size;
+        }
+    }
+    for (auto& allocation : live) {
+        verify_payload(allocation);
+        sfree(allocation.payload);
+    }
+}
+
+bool statistics_sanity_assertion() {
+    bool valid = true;
+    REQUIRE(valid = valid && (FULL_allocated_blocks_count() == FULL_free_blocks_count() + FULL_used_blocks_count()));
+    REQUIRE(valid = valid && (FULL_free_blocks_count() == (int)_num_free_blocks()));
+    REQUIRE(valid = valid && (FULL_free_blocks_bytes() == (int)_num_free_bytes()));
+    REQUIRE(valid = valid && (FULL_allocated_blocks_count() == (int)_num_allocated_blocks()));
+    REQUIRE(valid = valid && (FULL_allocated_blocks_bytes() == (int)_num_allocated_bytes()));
+    REQUIRE(valid = valid && (FULL_metadata_bytes() == (int)_num_meta_data_bytes()));
+    return valid;
+}
+
+//Runs the workers, frees everything, and checks the statistics against a census of the heap.
+void run_workers() {
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREAD_COUNT; ++i) {
+        threads.emplace_back(worker, i);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (auto& slot : handoffs) {
+        if (auto handed = slot.exchange(nullptr)) {
+            verify_payload(*handed);
+            sfree(handed->payload);
+            delete handed;
+        }
+    }
+
+    //Exited threads flushed their own caches already; the rest is parked until handed back explicitly.
+    _drain_remote_frees();
+    REQUIRE(_num_remote_free_blocks() == 0);
+    _flush_thread_cache();
+    _drain_lock_free_stacks();
+    _flush_cpu_caches();
+
+    REQUIRE(statistics_sanity_assertion());
+    //Everything was freed, so the heap must have coalesced back into whole max-order blocks.
+    REQUIRE(_num_free_blocks() == _num_allocated_blocks());
+    REQUIRE(_num_free_blocks() % 32 == 0);
+    REQUIRE(_num_free_bytes() == _num_free_blocks() * (128 * 1024 - _size_meta_data()));
+}
+
+template <typename Setup>
+bool run_in_child(const char* name, Setup setup) {
+    auto pid = fork();
+    if (pid == 0) {
+        setup();
+        run_workers();
+        exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    bool passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    std::cout << name << ": " << (passed ? "passed" : "!!!!!!!!!!!!!!!!!!!!!!failed!!!!!!!!!!!!!!!!!!!!!!") << "."
+              << std::endl;
+    return passed;
+}
+
+void set_thread_caches(int max_blocks) {
+    for (int order = 0; order <= 10; ++order) {
+        _set_thread_cache_limit(order, max_blocks);
+    }
+}
+
+int main() {
+    bool passed = true;
+    passed &= run_in_child("default", [] {});
+    passed &= run_in_child("thread caches", [] { set_thread_caches(8); });
+    passed &= run_in_child("thread caches with stealing", [] {
+        set_thread_caches(8);
+        _set_thread_cache_stealing(true);
+    });
+    passed &= run_in_child("arenas by thread", [] { _set_arenas(4, false); });
+    passed &= run_in_child("arenas by CPU", [] { _set_arenas(4, true); });
+    passed &= run_in_child("arenas with remote free queues", [] {
+        _set_arenas(4, false);
+        _set_remote_free_queues(true);
+    });
+    passed &= run_in_child("CPU caches", [] { _set_cpu_cache_limit(8); });
+    passed &= run_in_child("lock-free stacks", [] { _set_lock_free_stacks(8); });
+    passed &= run_in_child("everything", [] {
+        _set_arenas(3, false);
+        _set_remote_free_queues(true);
+        set_thread_caches(4);
+        _set_thread_cache_stealing(true);
+        _set_cpu_cache_limit(8);
+        _set_lock_free_stacks(8);
+    });
+    return passed ? 0 : 1;
+}
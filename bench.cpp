@@ -0,0 +1,360 @@
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <atomic>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+using std::cout;
+using std::endl;
+
+void* smalloc(size_t size);
+void sfree(void* p);
+
+void _set_hugepage_heap(bool enabled);
+size_t _num_hugetlb_mappings();
+size_t _num_thp_mappings();
+void _set_thread_cache_limit(int order, int max_blocks);
+void _set_arenas(int count, bool by_cpu);
+void _set_cpu_cache_limit(int max_blocks);
+bool _cpu_caches_available();
+void _set_lock_free_stacks(int max_blocks);
+void _set_thread_cache_stealing(bool enabled);
+size_t _num_stolen_batches();
+void _set_remote_free_queues(bool enabled);
+size_t _num_remote_free_blocks();
+
+/*
+ * Allocator benchmarks. Each one runs in a forked child, so that it starts from a fresh allocator.
+ * Build (outside of the DEBUG build): g++ -std=c++17 -O2 -o bench malloc_4.cpp bench.cpp -lpthread
+ * Run: ./bench [name], where name is one of the benchmarks below (all of them by default).
+ */
+
+//Opens a counter of user-space dTLB load misses for this thread, or returns -1 when perf events aren't available.
+int openDtlbMissCounter() {
+    perf_event_attr attr{};
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+struct Node {
+    Node* next;
+};
+
+Node* volatile chase_result; //Keeps the chase from being optimized away.
+
+/*
+ * Chases pointers through a random cycle of small blocks spread over the whole buddy heap, so nearly every step
+ * lands on another page. Compares the default heap with a hugepage backed one.
+ */
+void pointerChase(bool hugepage_heap) {
+    const size_t node_count = 1 << 19; //Order-0 blocks, 64 MiB of heap in total.
+    const size_t steps = 1 << 24;
+
+    _set_hugepage_heap(hugepage_heap);
+    auto nodes = new Node*[node_count];
+    for (size_t i = 0; i < node_count; ++i) {
+        nodes[i] = (Node*)smalloc(100);
+        if (!nodes[i]) {
+            cout << "smalloc failed" << endl;
+            return;
+        }
+    }
+    srand(1);
+    for (size_t i = node_count - 1; i > 0; --i) {
+        std::swap(nodes[i], nodes[rand() % (i + 1)]);
+    }
+    for (size_t i = 0; i < node_count; ++i) {
+        nodes[i]->next = nodes[(i + 1) % node_count];
+    }
+
+    int counter = openDtlbMissCounter();
+    auto start = std::chrono::steady_clock::now();
+    if (counter != -1) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    auto node = nodes[0];
+    for (size_t i = 0; i < steps; ++i) {
+        node = node->next;
+    }
+    long long misses = -1;
+    if (counter != -1) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+        close(counter);
+    }
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    chase_result = node;
+
+    cout << (hugepage_heap ? "hugepage heap" : "default heap") << ": " << elapsed << " ms, dTLB load misses: ";
+    if (misses >= 0) {
+        cout << misses;
+    }
+    else {
+        cout << "n/a";
+    }
+    cout << " (hugetlb mappings: " << _num_hugetlb_mappings() << ", THP mappings: " << _num_thp_mappings() << ")" << endl;
+
+    for (size_t i = 0; i < node_count; ++i) {
+        sfree(nodes[i]);
+    }
+    delete[] nodes;
+}
+
+std::mutex big_lock;
+
+/*
+ * Every thread keeps a ring of live blocks of its own size class, and keeps replacing the oldest one. With locked,
+ * each call goes through one global mutex, the way callers had to wrap the allocator before it was thread safe.
+ */
+void allocFreeLoop(int thread_index, size_t operations, bool locked, int size_classes) {
+    const size_t ring_size = 64;
+    size_t size = (128 << (thread_index % size_classes)) - 16; //Fills a block of order 0 to size_classes - 1 exactly.
+    void* ring[ring_size] = {};
+    for (size_t i = 0; i < operations; ++i) {
+        auto& slot = ring[i % ring_size];
+        if (locked) {
+            std::lock_guard<std::mutex> held(big_lock);
+            sfree(slot);
+            slot = smalloc(size);
+        }
+        else {
+            sfree(slot);
+            slot = smalloc(size);
+        }
+        *(char*)slot = (char)i;
+    }
+    for (auto block : ring) {
+        sfree(block);
+    }
+}
+
+//How the allocator is set up (or wrapped) for a thread scaling run.
+enum class Setup {
+    Default,      //One arena, no caches.
+    GlobalMutex,  //Every call wrapped in one mutex.
+    ThreadCaches, //A per-thread cache of 32 blocks for every order.
+    Arenas,       //As many arenas as threads, picked by thread id, since the threads may share a CPU here.
+    CpuCaches,    //A per-CPU cache of 32 blocks for orders 0 to 3.
+    FreeStacks,   //A lock-free stack of up to 32 blocks per order.
+};
+
+const char* setupName(Setup setup) {
+    switch (setup) {
+        case Setup::GlobalMutex: return ", global mutex";
+        case Setup::ThreadCaches: return ", thread caches";
+        case Setup::Arenas: return ", arenas";
+        case Setup::CpuCaches: return _cpu_caches_available() ? ", CPU caches" : ", CPU caches (no rseq, locked lists)";
+        case Setup::FreeStacks: return ", lock-free stacks";
+        default: return "";
+    }
+}
+
+void threadScaling(int thread_count, Setup setup, int size_classes=8) {
+    const size_t operations = 1000000;
+    const int thread_cache_limit = 32;
+    const int cpu_cache_limit = 32;
+    const int free_stack_limit = 32;
+    if (setup == Setup::ThreadCaches) {
+        for (int order = 0; order <= 10; ++order) {
+            _set_thread_cache_limit(order, thread_cache_limit);
+        }
+    }
+    if (setup == Setup::Arenas) {
+        _set_arenas(thread_count, false);
+    }
+    if (setup == Setup::CpuCaches) {
+        _set_cpu_cache_limit(cpu_cache_limit);
+    }
+    if (setup == Setup::FreeStacks) {
+        _set_lock_free_stacks(free_stack_limit);
+    }
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < thread_count; ++i) {
+        threads.emplace_back(allocFreeLoop, i, operations, setup == Setup::GlobalMutex, size_classes);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << thread_count << " threads" << setupName(setup) << ": "
+         << thread_count * operations / elapsed / 1e6 << " M alloc/free pairs per second" << endl;
+}
+
+//Single-producer single-consumer ring, for handing blocks from the producer to one consumer.
+struct HandoffRing {
+    static const size_t CAPACITY = 1024;
+    void* slots[CAPACITY];
+    std::atomic<size_t> head{0}; //Next slot to read.
+    std::atomic<size_t> tail{0}; //Next slot to write.
+
+    void push(void* block) {
+        auto at = tail.load(std::memory_order_relaxed);
+        while (at - head.load(std::memory_order_acquire) == CAPACITY) {
+            std::this_thread::yield();
+        }
+        slots[at % CAPACITY] = block;
+        tail.store(at + 1, std::memory_order_release);
+    }
+
+    void* pop() {
+        auto at = head.load(std::memory_order_relaxed);
+        while (at == tail.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        auto block = slots[at % CAPACITY];
+        head.store(at + 1, std::memory_order_release);
+        return block;
+    }
+};
+
+/*
+ * One producer allocates blocks of orders 0 and 1 and hands them round-robin to consumers that free them, so every
+ * free is a cross-thread one. Each thread gets an arena of its own; with queued, those frees go through the producer
+ * arena's remote free queue instead of its locked lists.
+ */
+void producerConsumer(int consumer_count, bool queued) {
+    const size_t blocks = 2000000;
+    _set_arenas(consumer_count + 1, false);
+    _set_remote_free_queues(queued);
+    std::vector<HandoffRing> rings(consumer_count);
+    std::vector<std::thread> consumers;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < consumer_count; ++i) {
+        consumers.emplace_back([&rings, i, consumer_count, blocks] {
+            for (size_t j = i; j < blocks; j += consumer_count) {
+                sfree(rings[i].pop());
+            }
+        });
+    }
+    size_t peak_depth = 0;
+    for (size_t j = 0; j < blocks; ++j) {
+        auto block = smalloc(j % 2 ? 100 : 200);
+        *(char*)block = (char)j;
+        rings[j % consumer_count].push(block);
+        if (j % 4096 == 0 && _num_remote_free_blocks() > peak_depth) {
+            peak_depth = _num_remote_free_blocks();
+        }
+    }
+    for (auto& consumer : consumers) {
+        consumer.join();
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << consumer_count << " consumers" << (queued ? ", remote free queues" : "") << ": "
+         << blocks / elapsed / 1e6 << " M blocks per second";
+    if (queued) {
+        cout << " (sampled peak queue depth: " << peak_depth << ")";
+    }
+    cout << endl;
+}
+
+/*
+ * Like the above, but in a single arena with thread caches of 64 blocks, so the consumers' caches fill up while the
+ * producer's keeps running dry. With stealing, the producer refills from the consumers' caches.
+ */
+void skewedCaching(int consumer_count, bool stealing) {
+    const size_t blocks = 2000000;
+    for (int order = 0; order <= 1; ++order) {
+        _set_thread_cache_limit(order, 64);
+    }
+    _set_thread_cache_stealing(stealing);
+    std::vector<HandoffRing> rings(consumer_count);
+    std::vector<std::thread> consumers;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < consumer_count; ++i) {
+        consumers.emplace_back([&rings, i, consumer_count, blocks] {
+            for (size_t j = i; j < blocks; j += consumer_count) {
+                sfree(rings[i].pop());
+            }
+        });
+    }
+    for (size_t j = 0; j < blocks; ++j) {
+        auto block = smalloc(j % 2 ? 100 : 200);
+        *(char*)block = (char)j;
+        rings[j % consumer_count].push(block);
+    }
+    for (auto& consumer : consumers) {
+        consumer.join();
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << consumer_count << " consumers, thread caches" << (stealing ? " with stealing" : "") << ": "
+         << blocks / elapsed / 1e6 << " M blocks per second";
+    if (stealing) {
+        cout << " (stolen batches: " << _num_stolen_batches() << ")";
+    }
+    cout << endl;
+}
+
+template <typename Benchmark>
+void runInChild(Benchmark benchmark) {
+    auto pid = fork();
+    if (pid == 0) {
+        benchmark();
+        exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char** argv) {
+    const char* name = argc > 1 ? argv[1] : nullptr;
+
+    if (!name || strcmp(name, "tlb") == 0) {
+        cout << "Pointer chasing over small blocks:" << endl;
+        runInChild([] { pointerChase(false); });
+        runInChild([] { pointerChase(true); });
+    }
+
+    if (!name || strcmp(name, "threads") == 0) {
+        cout << "Threads allocating and freeing different size classes (" << std::thread::hardware_concurrency()
+             << " hardware threads):" << endl;
+        for (int thread_count = 1; thread_count <= 16; thread_count *= 2) {
+            for (auto setup : {Setup::Default, Setup::GlobalMutex, Setup::ThreadCaches, Setup::Arenas}) {
+                runInChild([thread_count, setup] { threadScaling(thread_count, setup); });
+            }
+        }
+    }
+
+    if (!name || strcmp(name, "percpu") == 0) {
+        cout << "Threads allocating and freeing blocks of orders 0 to 3 (" << std::thread::hardware_concurrency()
+             << " hardware threads):" << endl;
+        for (int thread_count = 1; thread_count <= 64; thread_count *= 4) {
+            for (auto setup : {Setup::GlobalMutex, Setup::Default, Setup::CpuCaches, Setup::FreeStacks}) {
+                runInChild([thread_count, setup] { threadScaling(thread_count, setup, 4); });
+            }
+        }
+    }
+
+    if (!name || strcmp(name, "remote") == 0) {
+        cout << "One producer allocating, consumers freeing:" << endl;
+        for (int consumer_count = 1; consumer_count <= 8; consumer_count *= 2) {
+            runInChild([consumer_count] { producerConsumer(consumer_count, false); });
+            runInChild([consumer_count] { producerConsumer(consumer_count, true); });
+        }
+    }
+
+    if (!name || strcmp(name, "steal") == 0) {
+        cout << "One producer allocating, consumers freeing, through thread caches:" << endl;
+        for (int consumer_count = 1; consumer_count <= 8; consumer_count *= 2) {
+            runInChild([consumer_count] { skewedCaching(consumer_count, false); });
+            runInChild([consumer_count] { skewedCaching(consumer_count, true); });
+        }
+    }
+
+    return 0;
+}
@@ -6,8 +6,18 @@ struct MallocMetadata {
     bool is_free;
     MallocMetadata* next;
     MallocMetadata* prev;
+    MallocMetadata* next_free;
+    MallocMetadata* prev_free;
 };
 
+//Free blocks are binned by size class, where bin i holds sizes in [2^i, 2^(i+1)):
+const int BIN_COUNT = sizeof(size_t) * 8;
+MallocMetadata *free_bins[BIN_COUNT] = {};
+unsigned long long non_empty_bins = 0; //Bit i is set iff free_bins[i] is non-empty.
+
+//A free block is only split if the remainder could still serve a request of at least this many bytes:
+const size_t MIN_SPLIT_REMAINDER = 128;
+
 MallocMetadata *allocations = nullptr;
 MallocMetadata *last = nullptr;
 
@@ -16,28 +26,137 @@ int total_allocated_blocks = 0;
 size_t allocated_space = 0;
 size_t free_space = 0;
 
+int __binOf(size_t size) {
+    return BIN_COUNT - 1 - __builtin_clzl(size);
+}
+
+void __addToBin(MallocMetadata *block) {
+    int bin = __binOf(block->size);
+    block->prev_free = nullptr;
+    block->next_free = free_bins[bin];
+    if (free_bins[bin]) {
+        free_bins[bin]->prev_free = block;
+    }
+    free_bins[bin] = block;
+    non_empty_bins |= 1ULL << bin;
+}
+
+void __removeFromBin(MallocMetadata *block) {
+    int bin = __binOf(block->size);
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    }
+    else {
+        free_bins[bin] = block->next_free;
+    }
+    if (block->next_free) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    block->next_free = block->prev_free = nullptr;
+    if (!free_bins[bin]) {
+        non_empty_bins &= ~(1ULL << bin);
+    }
+}
+
 void __setBlockFree(MallocMetadata *block, bool free_value) {
     if (free_value == block->is_free) return;
     if (free_value) {
         free_space += block->size;
         ++free_blocks;
+        __addToBin(block);
     }
     else {
         free_space -= block->size;
         --free_blocks;
+        __removeFromBin(block);
     }
     block->is_free = free_value;
 }
 
 MallocMetadata *__findFreeBlock(size_t size) {
-    auto curr = allocations;
-    while (curr != nullptr) {
-        if (curr->is_free && curr->size >= size) {
+    //The request's own size class may hold blocks that are too small, so only that bin is searched first-fit:
+    int bin = __binOf(size);
+    for (auto curr = free_bins[bin]; curr != nullptr; curr = curr->next_free) {
+        if (curr->size >= size) {
             return curr;
         }
-        curr = curr->next;
     }
-    return nullptr;
+
+    //Any block in a larger size class fits, so the smallest non-empty one is taken:
+    auto larger_bins = bin + 1 < BIN_COUNT ? non_empty_bins & (~0ULL << (bin + 1)) : 0;
+    if (!larger_bins) {
+        return nullptr;
+    }
+    return free_bins[__builtin_ctzll(larger_bins)];
+}
+
+/*
+ * The allocations list is kept in address order, so a block's next/prev pointers double as boundary tags:
+ * its physical neighbours are one pointer away. They are only merged when really contiguous, since
+ * something else may have moved the program break between two of our sbrk calls.
+ */
+bool __areAdjacent(MallocMetadata *first, MallocMetadata *second) {
+    return (char*)(first + 1) + first->size == (char*)second;
+}
+
+//Merges a free block with its free physical successor.
+void __mergeWithNext(MallocMetadata *block) {
+    auto next = block->next;
+    __removeFromBin(block);
+    __removeFromBin(next);
+
+    block->size += sizeof(MallocMetadata) + next->size;
+    block->next = next->next;
+    if (next->next) {
+        next->next->prev = block;
+    }
+    else {
+        last = block;
+    }
+    __addToBin(block);
+
+    --free_blocks;
+    free_space += sizeof(MallocMetadata);
+    --total_allocated_blocks;
+    allocated_space += sizeof(MallocMetadata);
+}
+
+MallocMetadata *__coalesce(MallocMetadata *block) {
+    if (block->next && block->next->is_free && __areAdjacent(block, block->next)) {
+        __mergeWithNext(block);
+    }
+    if (block->prev && block->prev->is_free && __areAdjacent(block->prev, block)) {
+        block = block->prev;
+        __mergeWithNext(block);
+    }
+    return block;
+}
+
+//Splits the tail off an allocated block, if it's big enough to be worth keeping as a free block of its own.
+void __splitBlock(MallocMetadata *block, size_t size) {
+    size = (size + alignof(MallocMetadata) - 1) & ~(alignof(MallocMetadata) - 1); //Keeps the remainder's metadata aligned.
+    if (block->size < size + sizeof(MallocMetadata) + MIN_SPLIT_REMAINDER) {
+        return;
+    }
+
+    auto remainder = (MallocMetadata*)((char*)(block + 1) + size);
+    MallocMetadata metadata {
+        block->size - size - sizeof(MallocMetadata), false, block->next, block, nullptr, nullptr
+    };
+    *remainder = metadata;
+    if (block->next) {
+        block->next->prev = remainder;
+    }
+    else {
+        last = remainder;
+    }
+    block->next = remainder;
+    block->size = size;
+
+    ++total_allocated_blocks;
+    allocated_space -= sizeof(MallocMetadata);
+    __setBlockFree(remainder, true);
+    __coalesce(remainder);
 }
 
 MallocMetadata *__addBlock(size_t size) {
@@ -50,7 +169,7 @@ MallocMetadata *__addBlock(size_t size) {
     allocated_space += size;
 
     MallocMetadata metadata {
-        size, false, nullptr, nullptr
+        size, false, nullptr, nullptr, nullptr, nullptr
     };
     *addr = metadata;
 
@@ -65,15 +184,42 @@ MallocMetadata *__addBlock(size_t size) {
     return addr;
 }
 
+//The wilderness block is the last block, as long as nothing else has moved the program break past it.
+bool __isWilderness(MallocMetadata *block) {
+    return block == last && (char*)(block + 1) + block->size == sbrk(0);
+}
+
+//Grows an allocated wilderness block by just the shortfall, instead of sbrk'ing a whole new block.
+bool __extendWilderness(MallocMetadata *block, size_t size) {
+    auto shortfall = size - block->size;
+    if (sbrk(shortfall) == (void*)-1) {
+        return false;
+    }
+    block->size = size;
+    allocated_space += shortfall;
+    return true;
+}
+
 MallocMetadata* __findOrAllocateBlock(size_t size) {
     if (size == 0 || size > 100000000) return nullptr;
 
     auto block = __findFreeBlock(size);
     if (block) {
         __setBlockFree(block, false);
+        __splitBlock(block, size);
         return block;
     }
 
+    if (last && last->is_free && __isWilderness(last)) {
+        block = last;
+        __setBlockFree(block, false);
+        if (__extendWilderness(block, size)) {
+            return block;
+        }
+        __setBlockFree(block, true);
+        return nullptr;
+    }
+
     return __addBlock(size);
 }
 
@@ -107,6 +253,7 @@ void sfree(void* p) {
     }
 
     __setBlockFree(pointer, true);
+    __coalesce(pointer);
 }
 
 void *srealloc(void* oldp, size_t size) {
@@ -121,14 +268,19 @@ void *srealloc(void* oldp, size_t size) {
         return oldp;
     }
 
+    if (size <= 100000000 && __isWilderness(old_block) && __extendWilderness(old_block, size)) {
+        return oldp;
+    }
+
     auto newp = (char*)smalloc(size);
     if (newp == nullptr) {
         return nullptr;
     }
 
-    std::memmove(newp, oldp, size);
+    std::memmove(newp, oldp, old_block->size);
 
     __setBlockFree(old_block, true);
+    __coalesce(old_block);
     return newp;
 }
 
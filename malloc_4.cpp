@@ -1,8 +1,24 @@
 #include <unistd.h>
 #include <cstring>
+#include <cstdint>
 #include <sys/mman.h>
+#include <sys/random.h>
 #include <cstdlib>
 #include <ctime>
+#include <time.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <sched.h>
+
+//Restartable sequences need their critical sections in assembly, and ThreadSanitizer can't see through those.
+#if defined(__x86_64__) && defined(__linux__) && __has_include(<sys/rseq.h>) && !defined(__SANITIZE_THREAD__)
+#include <sys/rseq.h>
+#define RSEQ_CPU_CACHES
+#endif
 
 #ifdef DEBUG
 #include <iostream>
@@ -10,138 +26,616 @@
 
 const size_t BASE_ORDER_SIZE = 128;
 const int MAX_ORDER = 10;
-const unsigned long BLOCK_COUNT = 32;
+const unsigned long BLOCK_COUNT = 32; //Max-order blocks per heap extent; the heap starts with one and grows by more.
 const unsigned long VM_HUGEPAGE_LENGTH = 2048 * 1024; //2048 kB, as per /proc/meminfo on the VM.
 const unsigned long SMALLOC_HUGEPAGE_THRESHOLD = 1024 * 1024 * 4; //4 MB, as per the instructions
 const unsigned long SCALLOC_HUGEPAGE_THRESHOLD = 1024 * 1024 * 2; //2 MB, as per the instructions
 
 const int ORDER_COUNT = MAX_ORDER + 1;
 
+//Upper bound on the number of independent buddy arenas; see ArenaSet.
+const int MAX_ARENAS = 16;
+
+//The per-CPU caches cover orders 0 to CPU_CACHE_ORDERS - 1.
+const int CPU_CACHE_ORDERS = 4;
+
+//When releasing free max-order blocks is enabled, releases start once more than RELEASE_HIGH_WATERMARK of them are
+//resident, and then go on until only RELEASE_LOW_WATERMARK are left, so a free/allocate cycle doesn't thrash.
+const int RELEASE_HIGH_WATERMARK = 8;
+const int RELEASE_LOW_WATERMARK = 2;
+
+//Freed mappings are cached for reuse by later large allocations, up to this many bytes, and for at most this long.
+const size_t MAPPING_CACHE_MAX_BYTES = 1024 * 1024 * 32;
+const unsigned long MAPPING_CACHE_DECAY_MS = 1000;
+
+//The pre-zeroing thread only clears blocks once the application hasn't called into the allocator for this long.
+const unsigned long ZERO_POOL_IDLE_MS = 2;
+
+/*
+ * Block header. The cookie, the order and the flags share a single word; the second word only carries the size of
+ * memory mapped blocks, since buddy blocks derive theirs from the order. The free list links are not part of the
+ * header at all: they live in the first bytes of a free block's payload, which nobody else is using at that point.
+ * Buddy blocks carry their header in front of the payload; memory mapped blocks keep it out of band (see MappedBlock).
+ */
 struct MallocMetadata {
 private:
-    unsigned int cookie;
-    size_t size;
-    bool is_free;
-    MallocMetadata* next;
-    MallocMetadata* prev;
-    bool hugepage;
+    static const uint64_t ORDER_MASK = 0xf;
+    static const uint64_t FREE_FLAG = 1 << 4;
+    static const uint64_t HUGEPAGE_FLAG = 1 << 5;
+    static const uint64_t MAPPED_FLAG = 1 << 6;
+    static const uint64_t RELEASED_FLAG = 1 << 7;
+    static const uint64_t ZEROED_FLAG = 1 << 8;
+    static const uint64_t CACHED_FLAG = 1 << 9;
+    static const int ARENA_SHIFT = 10; //Buddy blocks only: the arena whose heap the block belongs to.
+    static const uint64_t ARENA_MASK = 0xf;
+    static const uint64_t POOL_ZEROED_FLAG = 1 << 14;
+    static const int COOKIE_SHIFT = 32;
+
+    uint64_t tag;
+    size_t mapped_size;
+
+    struct FreeLinks {
+        MallocMetadata* next;
+        MallocMetadata* prev;
+    };
+
+    FreeLinks* links() {
+        return (FreeLinks*)(this + 1);
+    }
+    const FreeLinks* links() const {
+        return (const FreeLinks*)(this + 1);
+    }
+
     void validate_cookie(unsigned int true_cookie) const {
-        if (cookie != true_cookie) {
+        if ((unsigned int)(tag >> COOKIE_SHIFT) != true_cookie) {
             exit(0xdeadbeef);
         }
     }
+
+    //Other threads read the tag of a block while looking for its buddy, so the owner stores it as a whole word.
+    void storeTag(uint64_t new_tag) {
+        __atomic_store_n(&tag, new_tag, __ATOMIC_RELAXED);
+    }
+
+    void setFlag(uint64_t flag, bool value) {
+        storeTag(value ? (tag | flag) : (tag & ~flag));
+    }
+
+    void setSizeField(size_t new_size) {
+        if (new_size > (BASE_ORDER_SIZE << MAX_ORDER)) {
+            storeTag(tag | MAPPED_FLAG);
+            mapped_size = new_size;
+        }
+        else {
+            storeTag((tag & ~(ORDER_MASK | MAPPED_FLAG)) | (uint64_t)(__builtin_ctzl(new_size / BASE_ORDER_SIZE)));
+            mapped_size = 0;
+        }
+    }
 public:
-    MallocMetadata(size_t size, bool is_free, MallocMetadata* next, MallocMetadata* prev, int cookie, size_t singleBlockSize=0)
-            : cookie(cookie), size(size), is_free(is_free), next(next), prev(prev), hugepage(isHugepageSized(size, singleBlockSize)) {}
+    MallocMetadata(size_t size, bool is_free, unsigned int cookie, bool hugepage=false)
+            : tag((uint64_t)cookie << COOKIE_SHIFT), mapped_size(0) {
+        setSizeField(size);
+        setFlag(FREE_FLAG, is_free);
+        setFlag(HUGEPAGE_FLAG, hugepage);
+    }
 
     size_t getSize(unsigned int true_cookie) const {
         validate_cookie(true_cookie);
-        return size;
+        return (tag & MAPPED_FLAG) ? mapped_size : BASE_ORDER_SIZE << (tag & ORDER_MASK);
     }
 
-    void addToSize(unsigned int true_cookie, long by) {
+    //Only meaningful for buddy blocks, whose size is always that of an order.
+    int getOrder(unsigned int true_cookie) const {
         validate_cookie(true_cookie);
-        size += by;
+        return (int)(tag & ORDER_MASK);
+    }
+
+    void addToSize(unsigned int true_cookie, long by) {
+        setSizeField(getSize(true_cookie) + by);
     }
 
     MallocMetadata* split(unsigned int true_cookie) {
-        validate_cookie(true_cookie);
-        auto buddy = (MallocMetadata*)((char*)this + size/2);
-        size /= 2;
-        *buddy = MallocMetadata(size, true, nullptr, nullptr, cookie);
+        auto half = getSize(true_cookie) / 2;
+        auto buddy = (MallocMetadata*)((char*)this + half);
+        setSizeField(half);
+        *buddy = MallocMetadata(half, true, true_cookie);
+        buddy->setFlag(ZEROED_FLAG, tag & ZEROED_FLAG); //The upper half was zeroed payload before its header went in.
+        buddy->setFlag(POOL_ZEROED_FLAG, tag & POOL_ZEROED_FLAG);
+        buddy->setArena(getArena());
         return buddy;
     }
 
     bool getIsFree(unsigned int true_cookie) const {
         validate_cookie(true_cookie);
-        return is_free;
+        return tag & FREE_FLAG;
+    }
+
+    //Whether this is a free buddy block of exactly size bytes, read in one go, as its owner may be rewriting it.
+    bool isFreeWithSize(unsigned int true_cookie, size_t size) const {
+        auto snapshot = __atomic_load_n(&tag, __ATOMIC_RELAXED);
+        if ((unsigned int)(snapshot >> COOKIE_SHIFT) != true_cookie) {
+            exit(0xdeadbeef);
+        }
+        return (snapshot & FREE_FLAG) && !(snapshot & MAPPED_FLAG) && (BASE_ORDER_SIZE << (snapshot & ORDER_MASK)) == size;
     }
 
     void setIsFree(unsigned int true_cookie, int new_is_free) {
         validate_cookie(true_cookie);
-        is_free = new_is_free;
+        setFlag(FREE_FLAG, new_is_free);
+    }
+
+    //Released blocks are free max-order blocks whose pages (past the first) were handed back to the OS.
+    bool getIsReleased(unsigned int true_cookie) const {
+        validate_cookie(true_cookie);
+        return tag & RELEASED_FLAG;
+    }
+
+    void setIsReleased(unsigned int true_cookie, bool new_is_released) {
+        validate_cookie(true_cookie);
+        setFlag(RELEASED_FLAG, new_is_released);
+    }
+
+    /*
+     * Zeroed blocks are known to hold zeros in every payload byte past linksSize(), i.e. everything but the free list
+     * links (which free blocks always carry). Fresh heap memory and fresh mappings start out that way.
+     */
+    bool getIsZeroed(unsigned int true_cookie) const {
+        validate_cookie(true_cookie);
+        return tag & ZEROED_FLAG;
+    }
+
+    void setIsZeroed(unsigned int true_cookie, bool new_is_zeroed) {
+        validate_cookie(true_cookie);
+        setFlag(ZEROED_FLAG, new_is_zeroed);
+        if (!new_is_zeroed) {
+            setFlag(POOL_ZEROED_FLAG, false);
+        }
+    }
+
+    //Zeroed blocks that the zero pool cleared (all or part of), rather than the kernel. Only for its statistics.
+    bool getIsPoolZeroed(unsigned int true_cookie) const {
+        validate_cookie(true_cookie);
+        return tag & POOL_ZEROED_FLAG;
     }
 
+    void setIsPoolZeroed(unsigned int true_cookie, bool new_is_pool_zeroed) {
+        validate_cookie(true_cookie);
+        setFlag(POOL_ZEROED_FLAG, new_is_pool_zeroed);
+    }
+
+    //Cached blocks are parked in a thread or CPU cache, a lock-free stack or a remote free queue: allocated as far as
+    //the buddy heap is concerned, but not in use.
+    bool getIsCached(unsigned int true_cookie) const {
+        validate_cookie(true_cookie);
+        return tag & CACHED_FLAG;
+    }
+
+    void setIsCached(unsigned int true_cookie, bool new_is_cached) {
+        validate_cookie(true_cookie);
+        setFlag(CACHED_FLAG, new_is_cached);
+    }
+
+    static size_t linksSize() {
+        return sizeof(FreeLinks);
+    }
+
+    //The links below are only meaningful while the block sits in a free list.
     MallocMetadata* getNext(unsigned int true_cookie) const {
         validate_cookie(true_cookie);
-        return next;
+        return links()->next;
     }
 
     void setNext(unsigned int true_cookie, MallocMetadata* new_next) {
         validate_cookie(true_cookie);
-        next = new_next;
+        links()->next = new_next;
     }
 
     MallocMetadata* getPrev(unsigned int true_cookie) const {
         validate_cookie(true_cookie);
-        return prev;
+        return links()->prev;
     }
 
     void setPrev(unsigned int true_cookie, MallocMetadata* new_prev) {
         validate_cookie(true_cookie);
-        prev = new_prev;
+        links()->prev = new_prev;
+    }
+
+    /*
+     * Blocks on the lock-free and per-CPU stacks only use the next link, so the prev one holds the depth of the stack
+     * from that block down. Another thread may read both of a block that is just being popped and reused; such reads
+     * are only trusted if the stack's head didn't change meanwhile, but they still have to be single loads. (A race
+     * detector flags them against the new owner's writes all the same.)
+     */
+    MallocMetadata* loadStackNext() const {
+        return __atomic_load_n(&links()->next, __ATOMIC_RELAXED);
+    }
+
+    size_t loadStackDepth() const {
+        return (size_t)__atomic_load_n(&links()->prev, __ATOMIC_RELAXED);
+    }
+
+    void setStackLinks(unsigned int true_cookie, MallocMetadata* new_next, size_t depth) {
+        validate_cookie(true_cookie);
+        links()->next = new_next;
+        links()->prev = (MallocMetadata*)depth;
     }
 
-    size_t getHugepageAlignedSize(unsigned int true_cookie) {
+    bool getIsHugepage(unsigned int true_cookie) const {
         validate_cookie(true_cookie);
-        if (!hugepage) return size;
-        auto hugepage_count = ((int)size / VM_HUGEPAGE_LENGTH) + ((size % VM_HUGEPAGE_LENGTH) != 0);
-#ifdef DEBUG
-        std::cout << "HUGEPAGE ALIGNED: " << hugepage_count * VM_HUGEPAGE_LENGTH << std::endl;
-#endif
-        return hugepage_count * VM_HUGEPAGE_LENGTH;
+        return tag & HUGEPAGE_FLAG;
     }
 
-    static bool isHugepageSized(size_t size, size_t singleBlockSize=0) {
-        bool hugepage;
-        if (singleBlockSize > 0) {
-            hugepage = singleBlockSize > SCALLOC_HUGEPAGE_THRESHOLD; //Says *larger*.
-        }
-        else {
-            hugepage = size - sizeof(MallocMetadata) >= SMALLOC_HUGEPAGE_THRESHOLD; //Says *equal-to or larger*.
-        }
-        return hugepage;
+    /*
+     * Read without checking the cookie, since each arena has its own and this is how a block's arena is found in the
+     * first place. The arena checks the cookie itself as soon as it touches the block.
+     */
+    unsigned int getArena() const {
+        return (tag >> ARENA_SHIFT) & ARENA_MASK;
+    }
+
+    void setArena(unsigned int arena) {
+        storeTag((tag & ~(ARENA_MASK << ARENA_SHIFT)) | ((uint64_t)arena << ARENA_SHIFT));
     }
+
+    //Takes the payload size; mapped blocks keep their header out of band, so it's all that the mapping has to hold.
+    static bool isHugepageSized(size_t size, size_t singleBlockSize=0);
 };
 
+static_assert(BLOCK_COUNT * (BASE_ORDER_SIZE << MAX_ORDER) % VM_HUGEPAGE_LENGTH == 0,
+              "Heap extents must be made of whole hugepages to be hugepage backed");
+static_assert(MAX_ARENAS <= 16, "The arena index has four bits in the block header");
+static_assert(sizeof(MallocMetadata) == 16, "MallocMetadata is meant to be two words");
+static_assert(sizeof(MallocMetadata) + 2 * sizeof(MallocMetadata*) <= BASE_ORDER_SIZE,
+              "Free list links must fit in the payload of an order-0 block");
+
+bool MallocMetadata::isHugepageSized(size_t size, size_t singleBlockSize) {
+    bool hugepage;
+    if (singleBlockSize > 0) {
+        hugepage = singleBlockSize > SCALLOC_HUGEPAGE_THRESHOLD; //Says *larger*.
+    }
+    else {
+        hugepage = size >= SMALLOC_HUGEPAGE_THRESHOLD; //Says *equal-to or larger*.
+    }
+    return hugepage;
+}
+
+/*
+ * Thread safety: each order's free lists (free_blocks, zeroed_blocks, and released_blocks for the max order) are
+ * guarded by that order's lock, and a thread holds at most one of them at a time, except for in-place growth, which
+ * takes them in increasing order. A block off every list belongs to whoever took it, so splitting and merging work
+ * on blocks nobody else can reach, and only take a lock to check or file a buddy. Heap growth is serialized by
+ * growth_lock, and memory mapped blocks (their side table and the mapping cache) by mapping_lock.
+ * Statistics are atomic counters kept per order (see Statistics); the FULL_* census walks are only meaningful while no
+ * other thread is running.
+ * Each instance is one arena (see ArenaSet); only arena 0 keeps memory mapped blocks, and the others hand theirs to it.
+ */
 class BuddyAllocator {
 private:
-    MallocMetadata* base_heap_addr = nullptr;
+    unsigned int arena_index = 0;
+    BuddyAllocator* mapping_owner = this; //The arena that keeps memory mapped blocks: arena 0.
+
+    /*
+     * The statistics are kept per order, next to the order's lock, and added up when read, so that threads working on
+     * different orders don't keep writing to one shared cache line. A change is counted with the order of the block
+     * it is about, and memory mapped blocks have a line of their own; a single slot may go below 0, the sums can't.
+     */
+    struct Statistics {
+        std::atomic<long> free_blocks{0};
+        std::atomic<long> allocated_blocks{0};
+        std::atomic<long> free_bytes{0};
+        std::atomic<long> allocated_bytes{0};
+    };
+    struct alignas(64) OrderLock { //Cache line aligned, so threads on neighbouring orders don't share one.
+        std::mutex lock;
+        Statistics stats;
+    };
+    OrderLock order_locks[ORDER_COUNT];
+    struct alignas(64) MappingStatistics {
+        Statistics stats;
+    };
+    MappingStatistics mapping_statistics;
+    std::mutex growth_lock;
+    std::mutex mapping_lock;
+
+    //The buddy heap is a set of extents of BLOCK_COUNT max-order blocks each, every one aligned to the max-order size.
+    struct HeapExtent {
+        MallocMetadata* begin;
+        MallocMetadata* end;
+    };
+    HeapExtent* extents = nullptr;
+    size_t extent_count = 0;
+    size_t extent_capacity = 0;
     int base_order;
     MallocMetadata* free_blocks[MAX_ORDER + 1];
-    MallocMetadata* used_blocks = nullptr;
-    MallocMetadata* mmapped_blocks = nullptr;
-    bool initialized = false;
-    int free_block_count = 0;
-    int total_allocated_blocks = 0;
-    size_t allocated_space = 0;
-    size_t free_space = 0;
+    MallocMetadata* zeroed_blocks[MAX_ORDER + 1]; //Free blocks whose payload is known to be zero, past the links.
+    int zeroed_counts[MAX_ORDER + 1];
+
+    /*
+     * Memory mapped blocks keep their header out of band, so their payload starts right at the (page or hugepage
+     * aligned) mapping, and an N-hugepage request takes exactly N hugepages. The headers live in this open addressing
+     * table keyed by payload address. Buddy payloads always sit sizeof(MallocMetadata) past an order-0 boundary, so a
+     * page aligned pointer can only be a mapped block's. Entries move whenever a mapping is tracked or untracked, so a
+     * header pointer into the table is only good until then.
+     */
+    struct MappedBlock {
+        MallocMetadata header; //First, so a header pointer is also its entry's.
+        void* payload;         //nullptr for an empty slot.
+        size_t length;         //As mapped, which is more than the size calls for when reused from the cache.
+    };
+    static const size_t MAPPED_TABLE_MIN_CAPACITY = 256;
+    MappedBlock* mapped_blocks = nullptr;
+    size_t mapped_capacity = 0; //A power of two.
+    size_t mapped_count = 0;
+
+    std::once_flag initialized;
     int cookie = 0;
+    size_t page_size = 0;
+
+    //Free max-order blocks are either resident (in free_blocks[MAX_ORDER]) or released (in released_blocks).
+    std::atomic<int> release_advice{0}; //The madvise advice used to release blocks, or 0 to keep them resident.
+    MallocMetadata* released_blocks = nullptr;
+    std::atomic<int> resident_max_blocks{0};
+    std::atomic<size_t> released_bytes{0};
+
+    //How hugepage-sized mappings were backed: by reserved hugetlbfs pages, or by transparent hugepages as a fallback.
+    std::atomic<size_t> hugetlb_mappings{0};
+    std::atomic<size_t> thp_mappings{0};
+    bool hugepage_heap = false; //Whether new heap extents are hugepage backed.
+
+    /*
+     * Cache of freed mappings. A cached mapping keeps its header, and its entry lives right after it, in memory
+     * nobody else uses anymore. Entries are bucketed by floor(log2(length)) for lookup, and are also kept on an
+     * age list (newest first) so that eviction and decay always drop the oldest ones.
+     */
+    struct CachedMapping {
+        MallocMetadata* bucket_next;
+        MallocMetadata* bucket_prev;
+        MallocMetadata* newer;
+        MallocMetadata* older;
+        size_t length;
+        unsigned long cached_at_ms;
+    };
+    static const int MAPPING_BUCKET_COUNT = sizeof(size_t) * 8;
+    MallocMetadata* mapping_buckets[MAPPING_BUCKET_COUNT] = {};
+    MallocMetadata* newest_cached_mapping = nullptr;
+    MallocMetadata* oldest_cached_mapping = nullptr;
+    std::atomic<size_t> cached_mapping_bytes{0};
+    size_t mapping_cache_max_bytes = MAPPING_CACHE_MAX_BYTES;
+    unsigned long mapping_cache_decay_ms = MAPPING_CACHE_DECAY_MS;
+    static const unsigned long NO_MAPPING_DECAY_DUE = ~0ul;
+    std::atomic<unsigned long> mapping_decay_due_ms{NO_MAPPING_DECAY_DUE}; //When the oldest entry decays, read unlocked.
+
+    /*
+     * Optional pool of pre-zeroed blocks. While enabled, a background thread moves free blocks from free_blocks to
+     * zeroed_blocks during idle periods, until each order holds zero_pool_target of them.
+     */
+    std::mutex zero_pool_lock; //Only for sleeping on zero_pool_wakeup.
+    std::condition_variable zero_pool_wakeup;
+    std::thread zero_pool_thread;
+    std::atomic<bool> zero_pool_enabled{false};
+    std::atomic<bool> zero_pool_stop{false};
+    int zero_pool_target = 0;
+    std::atomic<unsigned long> operation_count{0}; //Only counted while the pool is enabled, to spot idle periods.
+    std::atomic<size_t> zero_pool_hits{0};
+    std::atomic<size_t> zero_pool_misses{0};
+#ifdef ADDRESS_ORDERED_LISTS
+    std::atomic<size_t> ordered_insert_steps{0};
+#endif
+
+    /*
+     * Optional per-thread caches in front of the free lists, one stack per order, for smalloc and sfree only. A
+     * cached block stays allocated as far as the buddy heap and the statistics are concerned, so the fast path touches
+     * nothing shared. An empty stack is refilled with a batch of half its limit's worth of blocks, and a stack that
+     * goes over its limit is flushed back down to half of it, each under a single order lock where possible.
+     * The caches are plain zero initialized thread_locals, so reaching them costs no initialization check; a
+     * thread's first use arms thread_cache_owner, whose destructor flushes its caches when the thread exits.
+     *
+     * With stealing on, a cache whose refill finds its order's free list empty takes a batch of that order's blocks
+     * from a sibling thread's cache before splitting a larger block. For that, each cache registers itself the first
+     * time it is refilled or flushed with stealing on, and from then on its owner holds its busy flag while working on
+     * it; a thief only ever tries the flag, and skips caches that are busy.
+     */
+    struct ThreadCache {
+        MallocMetadata* heads[ORDER_COUNT];
+        int counts[ORDER_COUNT];
+        int state; //One of the THREAD_CACHE_* states below.
+        bool stealable; //Registered on stealable_caches. Only ever changed by the owner, outside of busy.
+        std::atomic<bool> busy;
+        ThreadCache* next_stealable;
+        ThreadCache* prev_stealable;
+    };
+    static const int THREAD_CACHE_UNUSED = 0;
+    static const int THREAD_CACHE_ACTIVE = 1;
+    static const int THREAD_CACHE_RETIRED = 2; //The thread is exiting; whatever it frees from now on goes straight back.
+    struct ThreadCacheOwner {
+        ~ThreadCacheOwner();
+    };
+    static thread_local ThreadCache thread_caches[MAX_ARENAS]; //Each thread keeps a cache per arena.
+    static thread_local ThreadCacheOwner thread_cache_owner;
+    std::atomic<int> thread_cache_limits[ORDER_COUNT] = {}; //High-water mark per order, or 0 to bypass the caches.
+    std::atomic<bool> thread_cache_stealing{false};
+    std::mutex steal_lock; //Guards stealable_caches, and is held throughout a steal.
+    ThreadCache* stealable_caches = nullptr;
+    std::atomic<size_t> stolen_batches{0};
+
+    /*
+     * Optional per-CPU caches for the smallest orders, built on restartable sequences (rseq): a thread pushes onto and
+     * pops off the stack of the CPU it runs on in a short critical section, which the kernel restarts if the thread is
+     * preempted, migrated or signalled in the middle of it, so no lock or atomic read-modify-write is needed. Unlike
+     * the thread caches, the memory they hold is bounded by the number of CPUs rather than of threads. A stack's depth
+     * is kept in its top block (where the prev link would be), so that a push or pop commits with a single store.
+     * Threads that aren't registered with rseq just go on through the locked free lists.
+     */
+    struct alignas(64) CpuCache {
+        MallocMetadata* heads[CPU_CACHE_ORDERS];
+    };
+    std::atomic<CpuCache*> cpu_caches{nullptr}; //One per possible CPU, mapped when the caches are first enabled.
+    size_t cpu_cache_count = 0;
+    std::atomic<int> cpu_cache_limit{0}; //Blocks per CPU and order, or 0 to bypass the caches.
+
+    /*
+     * Blocks freed by threads that allocate from another arena (see ArenaSet) can be handed back through this queue
+     * instead of the arena's locked lists: a lock-free stack that foreign threads push onto with a CAS, and that the
+     * next allocation from the arena empties in one exchange, freeing the whole batch by order. Taking the stack as
+     * a whole, rather than popping it block by block, is what keeps it safe from ABA without tags.
+     */
+    std::atomic<MallocMetadata*> remote_frees{nullptr};
+    std::atomic<size_t> remote_free_depth{0};
+
+    /*
+     * Optional lock-free stack per order in front of the locked free lists. A freed block whose buddy isn't free (so
+     * there is nothing to merge) is pushed with a single CAS, and an allocation of exactly that order pops one with
+     * another; only merging and splitting take the order locks. Stacked blocks don't merge until they are popped or
+     * drained, so each stack is capped at free_stack_limit blocks. The head packs the top block's address (order-0
+     * aligned and below 2^47, so 40 bits of it are enough) with a 24-bit tag bumped on every change, so a pop that read
+     * a head, stalled, and meanwhile saw the block popped and pushed back can't succeed (ABA).
+     */
+    static const int STACK_ADDRESS_BITS = 40;
+    static const uint64_t STACK_ADDRESS_MASK = (1ull << STACK_ADDRESS_BITS) - 1;
+    std::atomic<uint64_t> free_stacks[ORDER_COUNT] = {};
+    std::atomic<int> free_stack_limit{0};
 
     //Auxiliary & convenience member functions & properties:
     size_t order_map[ORDER_COUNT];  //Just for minor runtime optimization purposes.
-    int order_from_size(size_t size) {
-        for (int i = 0; i < ORDER_COUNT; ++i) {
-            if (order_map[i] == size) {
-                return i;
-            }
+    int base_shift;                 //log2 of the order-0 block size.
+    //Only hints outside of the order locks: a set bit means the order had free blocks when it was last updated.
+    //On a cache line of their own, since every order's lock holder may write them.
+    struct alignas(64) OrderMasks {
+        std::atomic<unsigned int> free{0}; //Bit i is set iff order i has any free block, zeroed or released ones included.
+        std::atomic<unsigned int> zeroed{0}; //Bit i is set iff zeroed_blocks[i] is non-empty.
+    };
+    OrderMasks order_masks;
+
+    //Orders are powers of two, so the order is just the bit index of the size relative to order 0.
+    int order_from_size(size_t size) const {
+        if (size == 0 || (size & (size - 1)) != 0) {
+            return -1;
         }
-        return -1;
+        int order = (int)(sizeof(size_t) * 8 - 1) - __builtin_clzl(size) - base_shift;
+        return (order >= 0 && order < ORDER_COUNT) ? order : -1;
     }
 
-    MallocMetadata* aux_getBlockByAddressTraversal(int order, int index) {
-        return (MallocMetadata*)((char*)free_blocks[order] + order_map[order] * (index));
+    //Smallest order whose blocks can hold size bytes (metadata included), or -1 if none can.
+    int aux_minimalOrderFor(size_t size) const {
+        if (size <= order_map[0]) {
+            return 0;
+        }
+        int order = (int)(sizeof(size_t) * 8) - __builtin_clzl(size - 1) - base_shift;
+        return order < ORDER_COUNT ? order : -1;
     }
-    void aux_removeFromBlocksList(MallocMetadata* block, MallocMetadata** head=nullptr) {
-        if (!head) {
-            if (block->getIsFree(cookie)) {
-#ifdef DEBUG
-                std::cout << "aux_removeFromBlocksList only supports implicit list head if block is allocated." << std::endl;
-#endif
-                return;
+
+    //Called with the order's lock held; other orders update their own bits concurrently. Only writes on a change.
+    void aux_updateFreeOrdersMask(int order) {
+        aux_updateOrderBit(order_masks.free, order,
+                           free_blocks[order] || zeroed_blocks[order] || (order == MAX_ORDER && released_blocks));
+        aux_updateOrderBit(order_masks.zeroed, order, zeroed_blocks[order]);
+    }
+
+    static void aux_updateOrderBit(std::atomic<unsigned int>& mask, int order, bool set) {
+        if (((mask.load(std::memory_order_relaxed) >> order) & 1) == set) {
+            return;
+        }
+        if (set) {
+            mask.fetch_or(1u << order, std::memory_order_relaxed);
+        }
+        else {
+            mask.fetch_and(~(1u << order), std::memory_order_relaxed);
+        }
+    }
+
+    //Where the statistics changes about blocks of the given order go.
+    Statistics& aux_stats(int order) {
+        return order_locks[order].stats;
+    }
+
+    long aux_sumStatistic(std::atomic<long> Statistics::* statistic) const {
+        long sum = (mapping_statistics.stats.*statistic).load(std::memory_order_relaxed);
+        for (auto& order_lock : order_locks) {
+            sum += (order_lock.stats.*statistic).load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    //Maps length bytes starting at a multiple of alignment (a power of two), by over-mapping and trimming the slack.
+    static void* aux_mapAligned(size_t length, size_t alignment) {
+        auto raw = (char*)mmap(nullptr, length + alignment, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (raw == MAP_FAILED) {
+            return nullptr;
+        }
+        auto aligned = (char*)(((uintptr_t)raw + alignment - 1) & ~(uintptr_t)(alignment - 1));
+        if (aligned != raw) {
+            munmap(raw, aligned - raw);
+        }
+        munmap(aligned + length, raw + alignment - aligned);
+        return aligned;
+    }
+
+    /*
+     * Hugepage blocks come from the reserved hugetlbfs pool when there is one. Without it MAP_HUGETLB fails, so they
+     * fall back to a hugepage-aligned regular mapping that asks for transparent hugepages instead.
+     */
+    void* aux_mapHugepages(size_t length) {
+        auto memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED) {
+            ++hugetlb_mappings;
+            return memory;
+        }
+        memory = aux_mapAligned(length, VM_HUGEPAGE_LENGTH);
+        if (memory && madvise(memory, length, MADV_HUGEPAGE) == 0) {
+            ++thp_mappings;
+        }
+        return memory;
+    }
+
+    /*
+     * Extent memory comes from the program break while it can, and from an aligned mapping once sbrk fails.
+     * In hugepage heap mode it is mapped on hugepages first, whose alignment covers the max-order one.
+     * Only arena 0 uses the program break, since sbrk can't be shared; the other arenas always map their extents.
+     */
+    void* aux_obtainExtentMemory(size_t length) {
+        if (hugepage_heap) {
+            if (auto memory = aux_mapHugepages(length)) {
+                return memory;
+            }
+        }
+        if (arena_index != 0) {
+            return aux_mapAligned(length, order_map[MAX_ORDER]);
+        }
+        //Pad the program break up to a max-order boundary first, so buddies can be found by XOR-ing addresses:
+        auto misalignment = (uintptr_t)sbrk(0) % order_map[MAX_ORDER];
+        if (misalignment == 0 || sbrk(order_map[MAX_ORDER] - misalignment) != (void*)-1) {
+            auto memory = sbrk(length);
+            if (memory != (void*)-1 && (uintptr_t)memory % order_map[MAX_ORDER] == 0) {
+                return memory;
+            }
+        }
+        return aux_mapAligned(length, order_map[MAX_ORDER]);
+    }
+
+    //The registry is only read by heap walks; extents that continue the previous one just extend its entry.
+    bool aux_registerExtent(MallocMetadata* begin, MallocMetadata* end) {
+        if (extent_count > 0 && extents[extent_count - 1].end == begin) {
+            extents[extent_count - 1].end = end;
+            return true;
+        }
+        if (extent_count == extent_capacity) {
+            size_t new_capacity = extent_capacity ? extent_capacity * 2 : 64;
+            auto new_extents = (HeapExtent*)mmap(nullptr, new_capacity * sizeof(HeapExtent), PROT_READ | PROT_WRITE,
+                                                 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            if (new_extents == MAP_FAILED) {
+                return false;
+            }
+            if (extents) {
+                std::memcpy(new_extents, extents, extent_count * sizeof(HeapExtent));
+                munmap(extents, extent_capacity * sizeof(HeapExtent));
             }
-            head = isMemoryMapped(block) ? &mmapped_blocks : &used_blocks;
+            extents = new_extents;
+            extent_capacity = new_capacity;
         }
+        extents[extent_count++] = {begin, end};
+        return true;
+    }
+    void aux_removeFromBlocksList(MallocMetadata* block, MallocMetadata** head) {
 #ifdef DEBUG
         if (*head == nullptr) {
             std::cout << "Tried to remove block from an empty list!" << std::endl;
@@ -161,58 +655,248 @@ private:
         block->setPrev(cookie, nullptr);
     }
 
-    size_t aux_getMaxMergeableSize(MallocMetadata* block) {
-        auto curr = block;
-        auto curr_size = block->getSize(cookie);
-        while (order_from_size(curr->getSize(cookie)) < MAX_ORDER) {
-            auto buddy = aux_getBuddy(curr, curr_size);
-            if (!buddy) {
-                break;
+    /*
+     * Lists are LIFO by default: the block is pushed at the head, and coalescing is decided by the buddy's
+     * header rather than by list position, so nothing depends on the lists being sorted.
+     * Building with ADDRESS_ORDERED_LISTS restores address-sorted placement instead; its linear cost is
+     * counted in ordered_insert_steps (see _num_ordered_insert_steps()).
+     */
+    void aux_addToBlocksList(MallocMetadata** head_ptr, MallocMetadata* block) {
+#ifdef ADDRESS_ORDERED_LISTS
+        MallocMetadata* prev = nullptr;
+        auto curr = *head_ptr;
+        while (curr != nullptr && curr < block) {
+            prev = curr;
+            curr = curr->getNext(cookie);
+            ordered_insert_steps.fetch_add(1, std::memory_order_relaxed);
+        }
+        block->setNext(cookie, curr);
+        block->setPrev(cookie, prev);
+        if (curr) {
+            curr->setPrev(cookie, block);
+        }
+        if (prev) {
+            prev->setNext(cookie, block);
+        }
+        else {
+            *head_ptr = block;
+        }
+#else
+        block->setNext(cookie, *head_ptr);
+        block->setPrev(cookie, nullptr);
+        if (*head_ptr) {
+            (*head_ptr)->setPrev(cookie, block);
+        }
+        *head_ptr = block;
+#endif
+    }
+
+    size_t aux_mappedSlot(const void* payload) const {
+        return (((uintptr_t)payload >> 12) * 0x9e3779b97f4a7c15ull >> 32) & (mapped_capacity - 1);
+    }
+
+    MappedBlock* aux_findMapping(const void* payload) {
+        if (!mapped_capacity) {
+            return nullptr;
+        }
+        for (auto slot = aux_mappedSlot(payload); mapped_blocks[slot].payload; slot = (slot + 1) & (mapped_capacity - 1)) {
+            if (mapped_blocks[slot].payload == payload) {
+                return &mapped_blocks[slot];
             }
-            curr = curr < buddy ? curr : buddy;
-            curr_size = curr_size + buddy->getSize(cookie);
         }
-        return curr_size;
+        return nullptr;
     }
 
-    void aux_addToBlocksList(MallocMetadata** head_ptr, MallocMetadata* block) {
-        if (*head_ptr == nullptr) {
-            *head_ptr = block;
-            return;
+    //The table is kept at most half full; it doubles by mapping a new one and re-inserting every entry.
+    bool aux_growMappedTable() {
+        auto old_blocks = mapped_blocks;
+        auto old_capacity = mapped_capacity;
+        auto capacity = old_capacity ? 2 * old_capacity : MAPPED_TABLE_MIN_CAPACITY;
+        auto blocks = mmap(nullptr, capacity * sizeof(MappedBlock), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (blocks == MAP_FAILED) {
+            return false;
         }
-        else if ((*head_ptr) > block) {
-            block->setNext(cookie, *head_ptr);
-            block->getNext(cookie)->setPrev(cookie, block);
-            *head_ptr = block;
-            return;
+        mapped_blocks = (MappedBlock*)blocks;
+        mapped_capacity = capacity;
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old_blocks[i].payload) {
+                auto slot = aux_mappedSlot(old_blocks[i].payload);
+                while (mapped_blocks[slot].payload) {
+                    slot = (slot + 1) & (mapped_capacity - 1);
+                }
+                mapped_blocks[slot] = old_blocks[i];
+            }
+        }
+        if (old_blocks) {
+            munmap(old_blocks, old_capacity * sizeof(MappedBlock));
+        }
+        return true;
+    }
+
+    //Returns the header stored for the length bytes mapped at payload, or nullptr if the table couldn't grow.
+    MallocMetadata* aux_trackMapping(void* payload, const MallocMetadata& header, size_t length) {
+        if (2 * (mapped_count + 1) > mapped_capacity && !aux_growMappedTable()) {
+            return nullptr;
+        }
+        auto slot = aux_mappedSlot(payload);
+        while (mapped_blocks[slot].payload) {
+            slot = (slot + 1) & (mapped_capacity - 1);
         }
+        mapped_blocks[slot] = {header, payload, length};
+        ++mapped_count;
+        return &mapped_blocks[slot].header;
+    }
+
+    //Backward-shift deletion: later entries of the same probe run move up, so lookups never need tombstones.
+    void aux_untrackMapping(MallocMetadata* block) {
+        auto mask = mapped_capacity - 1;
+        auto hole = (size_t)((MappedBlock*)block - mapped_blocks);
+        mapped_blocks[hole].payload = nullptr;
+        --mapped_count;
+        for (auto slot = (hole + 1) & mask; mapped_blocks[slot].payload; slot = (slot + 1) & mask) {
+            auto home = aux_mappedSlot(mapped_blocks[slot].payload);
+            if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+                mapped_blocks[hole] = mapped_blocks[slot];
+                mapped_blocks[slot].payload = nullptr;
+                hole = slot;
+            }
+        }
+    }
 
-        auto head = *head_ptr;
-        MallocMetadata *next = head->getNext(cookie);
+    size_t aux_mappingLengthFor(size_t size, bool hugepage) const {
+        size_t granularity = hugepage ? VM_HUGEPAGE_LENGTH : page_size;
+        return (size + granularity - 1) / granularity * granularity;
+    }
 
-        while(head) {
-            if (next == nullptr) {
-                next = block;
-                return;
+    //What was actually mapped for a tracked block, never rebuilt from its header.
+    static size_t aux_mappingLength(MallocMetadata* block) {
+        return ((MappedBlock*)block)->length;
+    }
+
+    static CachedMapping* aux_cacheEntry(MallocMetadata* block) {
+        return (CachedMapping*)(block + 1);
+    }
+
+    static int aux_mappingBucket(size_t length) {
+        return MAPPING_BUCKET_COUNT - 1 - __builtin_clzl(length);
+    }
+
+    static unsigned long aux_nowMs() {
+        timespec now{};
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    }
+
+    void aux_uncacheMapping(MallocMetadata* block) {
+        auto entry = aux_cacheEntry(block);
+        auto bucket = aux_mappingBucket(entry->length);
+        if (entry->bucket_prev) aux_cacheEntry(entry->bucket_prev)->bucket_next = entry->bucket_next;
+        else mapping_buckets[bucket] = entry->bucket_next;
+        if (entry->bucket_next) aux_cacheEntry(entry->bucket_next)->bucket_prev = entry->bucket_prev;
+
+        if (entry->newer) aux_cacheEntry(entry->newer)->older = entry->older;
+        else newest_cached_mapping = entry->older;
+        if (entry->older) aux_cacheEntry(entry->older)->newer = entry->newer;
+        else oldest_cached_mapping = entry->newer;
+
+        cached_mapping_bytes -= entry->length;
+        aux_updateMappingDecayDue();
+    }
+
+    //Called with mapping_lock held, whenever the oldest entry or the decay time may have changed.
+    void aux_updateMappingDecayDue() {
+        mapping_decay_due_ms = oldest_cached_mapping
+                ? aux_cacheEntry(oldest_cached_mapping)->cached_at_ms + mapping_cache_decay_ms : NO_MAPPING_DECAY_DUE;
+    }
+
+    /*
+     * Applies the decay from the small-block slow paths too, so mappings cached before the program stopped making
+     * large allocations still go back to the OS. Costs one load while nothing is due, and never waits for the lock.
+     */
+    void aux_decayCachedMappingsIfDue() {
+        auto due = mapping_decay_due_ms.load(std::memory_order_relaxed);
+        if (due == NO_MAPPING_DECAY_DUE || aux_nowMs() <= due) {
+            return;
+        }
+        std::unique_lock<std::mutex> held(mapping_lock, std::try_to_lock);
+        if (held.owns_lock()) {
+            aux_evictCachedMappings(mapping_cache_max_bytes, aux_nowMs());
+        }
+    }
+
+    //Unmaps the oldest cached mappings until at most max_bytes are cached, along with any that decayed.
+    void aux_evictCachedMappings(size_t max_bytes, unsigned long now_ms) {
+        while (oldest_cached_mapping) {
+            auto block = oldest_cached_mapping;
+            auto entry = aux_cacheEntry(block);
+            if (cached_mapping_bytes <= max_bytes && now_ms - entry->cached_at_ms <= mapping_cache_decay_ms) {
+                break;
             }
-            else if (head->getNext(cookie) < block) {
-                block->setNext(cookie, next);
-                next->setPrev(cookie, block);
-                head->setNext(cookie, block);
-                return;
+            auto length = entry->length;
+            aux_uncacheMapping(block);
+            munmap(block, length);
+        }
+    }
+
+    bool aux_cacheMapping(MallocMetadata* block, size_t length) {
+        if (length > mapping_cache_max_bytes) {
+            return false;
+        }
+        auto now = aux_nowMs();
+        aux_evictCachedMappings(mapping_cache_max_bytes - length, now);
+
+        auto entry = aux_cacheEntry(block);
+        auto bucket = aux_mappingBucket(length);
+        *entry = {mapping_buckets[bucket], nullptr, nullptr, newest_cached_mapping, length, now};
+        if (mapping_buckets[bucket]) aux_cacheEntry(mapping_buckets[bucket])->bucket_prev = block;
+        mapping_buckets[bucket] = block;
+        if (newest_cached_mapping) aux_cacheEntry(newest_cached_mapping)->newer = block;
+        else oldest_cached_mapping = block;
+        newest_cached_mapping = block;
+
+        cached_mapping_bytes += length;
+        aux_updateMappingDecayDue();
+        return true;
+    }
+
+    //Finds a cached mapping of at least length bytes, wasting at most as much again, with matching page kind.
+    MallocMetadata* aux_takeCachedMapping(size_t length, bool hugepage) {
+        aux_evictCachedMappings(mapping_cache_max_bytes, aux_nowMs());
+        for (int bucket = aux_mappingBucket(length); bucket <= aux_mappingBucket(length) + 1 && bucket < MAPPING_BUCKET_COUNT; ++bucket) {
+            for (auto block = mapping_buckets[bucket]; block; block = aux_cacheEntry(block)->bucket_next) {
+                auto entry_length = aux_cacheEntry(block)->length;
+                if (entry_length >= length && entry_length <= 2 * length && block->getIsHugepage(cookie) == hugepage) {
+                    aux_uncacheMapping(block);
+                    return block;
+                }
             }
-            head = head->getNext(cookie);
         }
-#ifdef DEBUG
-        std::cout << "ERROR: aux_addToBlocksList failed." << std::endl;
-#endif
+        return nullptr;
     }
 
+    //Buddy blocks tile each extent back to back, so the heap can be walked block by block from each extent's start.
+    MallocMetadata* aux_nextInHeap(MallocMetadata* block) {
+        return (MallocMetadata*)((char*)block + block->getSize(cookie));
+    }
+
+    //Blocks are filed by their zeroed flag, so it must not change while they're on a list. Called with the order's lock held.
     void aux_addToFreeBlocks(MallocMetadata* block) {
-        aux_addToBlocksList(&free_blocks[order_from_size(block->getSize(cookie))], block);
+        int order = order_from_size(block->getSize(cookie));
+        if (order == MAX_ORDER) {
+            ++resident_max_blocks;
+        }
+        if (block->getIsZeroed(cookie)) {
+            aux_addToBlocksList(&zeroed_blocks[order], block);
+            ++zeroed_counts[order];
+        }
+        else {
+            aux_addToBlocksList(&free_blocks[order], block);
+        }
+        aux_updateFreeOrdersMask(order);
         block->setIsFree(cookie, true);
     }
 
+    //Called with the order's lock held. The block stays marked free; takers mark it allocated before letting go.
     void aux_removeFromFreeBlocks(MallocMetadata* block) {
         int order = order_from_size(block->getSize(cookie));
         if (order < 0) {
@@ -221,422 +905,1560 @@ private:
 #endif
             return;
         }
-        aux_removeFromBlocksList(block, &free_blocks[order]);
+        if (block->getIsReleased(cookie)) {
+            //It's about to be reused; its released pages simply fault back in as zero pages.
+            aux_removeFromBlocksList(block, &released_blocks);
+            block->setIsReleased(cookie, false);
+            released_bytes -= order_map[MAX_ORDER] - page_size;
+        }
+        else {
+            if (block->getIsZeroed(cookie)) {
+                aux_removeFromBlocksList(block, &zeroed_blocks[order]);
+                --zeroed_counts[order];
+            }
+            else {
+                aux_removeFromBlocksList(block, &free_blocks[order]);
+            }
+            if (order == MAX_ORDER) {
+                --resident_max_blocks;
+            }
+        }
+        aux_updateFreeOrdersMask(order);
     }
 
-    //Buddy here can be fetches by this function, but can also be passed as a parameter for efficiency.
-    void aux_mergeStep(MallocMetadata** block_ptr, MallocMetadata* buddy=nullptr) {
-        auto block = *block_ptr;
-        if (!buddy) {
-            buddy = aux_getBuddy(block);
-
-            if (buddy == nullptr || !buddy->getIsFree(cookie)) {
+    //The first page stays resident, since it holds the header and the free list links. Called with the max-order lock held.
+    void aux_releaseSurplusBlocks() {
+        while (resident_max_blocks > RELEASE_LOW_WATERMARK) {
+            auto block = free_blocks[MAX_ORDER] ? free_blocks[MAX_ORDER] : zeroed_blocks[MAX_ORDER];
+            aux_removeFromFreeBlocks(block);
+            if (madvise((char*)block + page_size, order_map[MAX_ORDER] - page_size, release_advice) == -1) {
 #ifdef DEBUG
-                std::cout << "Called aux_mergeStep with non-mergeable blocks.";
+                std::cout << "madvise failed, keeping free blocks resident." << std::endl;
 #endif
+                aux_addToFreeBlocks(block);
+                release_advice = 0;
                 return;
             }
+            block->setIsReleased(cookie, true);
+            if (release_advice == MADV_DONTNEED) {
+                //The rest of the block now reads as zero pages, so clearing the rest of the first page makes it zeroed.
+                auto first_page_rest = (char*)(block + 1) + MallocMetadata::linksSize();
+                std::memset(first_page_rest, 0, (char*)block + page_size - first_page_rest);
+                block->setIsZeroed(cookie, true);
+            }
+            aux_addToBlocksList(&released_blocks, block);
+            released_bytes += order_map[MAX_ORDER] - page_size;
+        }
+        aux_updateFreeOrdersMask(MAX_ORDER);
+    }
+
+    void aux_releaseIfAboveWatermark() {
+        if (release_advice && resident_max_blocks > RELEASE_HIGH_WATERMARK) {
+            std::lock_guard<std::mutex> held(order_locks[MAX_ORDER].lock);
+            if (release_advice && resident_max_blocks > RELEASE_HIGH_WATERMARK) {
+                aux_releaseSurplusBlocks();
+            }
         }
+    }
+
+    //Joins two buddies that were both taken off the lists into one block, which is returned.
+    MallocMetadata* aux_combineBuddies(MallocMetadata* block, MallocMetadata* buddy) {
         auto left_buddy = block < buddy ? block : buddy;
         auto right_buddy = block < buddy ? buddy : block; //Could do sum - min, but not sure if sum might overflow...
-        block = left_buddy;
-        buddy = right_buddy;
-        block->addToSize(cookie, buddy->getSize(cookie));
-        auto &free_list = free_blocks[order_from_size(buddy->getSize(cookie))]; //I hope references don't take up heap storage...
-        aux_removeFromBlocksList(block, &free_list);
-        aux_removeFromBlocksList(buddy, &free_list);
-        aux_addToFreeBlocks(block);
-        *block_ptr = block;
+        auto buddy_size = right_buddy->getSize(cookie);
+        auto& stats = aux_stats(right_buddy->getOrder(cookie));
+        bool zeroed = left_buddy->getIsZeroed(cookie) && right_buddy->getIsZeroed(cookie);
+        bool pool_zeroed = zeroed && (left_buddy->getIsPoolZeroed(cookie) || right_buddy->getIsPoolZeroed(cookie));
+        if (zeroed) {
+            //The right buddy's header and links become part of the merged payload, so they're all that needs clearing.
+            std::memset((void*)right_buddy, 0, sizeof(MallocMetadata) + MallocMetadata::linksSize());
+        }
+        left_buddy->addToSize(cookie, buddy_size);
+        left_buddy->setIsZeroed(cookie, zeroed);
+        left_buddy->setIsPoolZeroed(cookie, pool_zeroed);
 
         //Statistics changes due to merging:
-        --free_block_count;
-        free_space += sizeof(MallocMetadata);
-        allocated_space += sizeof(MallocMetadata);
-        --total_allocated_blocks;
+        --stats.free_blocks;
+        stats.free_bytes += sizeof(MallocMetadata);
+        stats.allocated_bytes += sizeof(MallocMetadata);
+        --stats.allocated_blocks;
+        return left_buddy;
     }
 
     /*
-     * This function could be substituted by keeping an integer and using it as a binary value,
-     * where each bit signifies whether the block is the left buddy or the right one
-     * (i.e whether its address was lower or higher, respectively). This only requires an extra
-     * integer and so wouldn't violate the metadata space requirements. This solution makes the metadata
-     * even smaller, though, so I'm going for that (although it might be a little slower).
+     * Merges a block nobody else can reach (not marked free, on no list) with its free buddies, then files it.
+     * Each order's lock is only held to check and take that order's buddy, or to file the final block, so frees
+     * of different orders don't wait on each other. Two buddies freed at once still meet: the one filed first under
+     * their order's lock is found there by the other.
      */
-    MallocMetadata* aux_getBuddy(MallocMetadata* block, size_t overwrite_size=0) {
-        size_t block_size = overwrite_size ? overwrite_size : block->getSize(cookie);
-        if (!initialized) return nullptr; //Shouldn't happen, but eh.
-        if (block_size == order_map[MAX_ORDER]) return nullptr; //No buddies for max-order blocks. (It's lonely at the top or something)
-
-        //Determine if left buddy or right buddy (i.e if buddy should have lower or higher address):
-        if ((((long)block - (long)base_heap_addr) % block_size) != 0) { //Sanity check but I'll leave it here
-#ifdef DEBUG
-            std::cout << "getBuddy sanity check failed: block addr is " << block
-                      << ", base heap addr is " << base_heap_addr
-                      << ", modulo results in " << (((long)block - (long)base_heap_addr) % block_size)
-                      << std::endl;
-#endif
-            return nullptr;
+    MallocMetadata* aux_coalesceAndFile(MallocMetadata* block) {
+        while (true) {
+            std::unique_lock<std::mutex> held(order_locks[block->getOrder(cookie)].lock);
+            auto buddy = aux_getBuddy(block);
+            if (!buddy) {
+                aux_addToFreeBlocks(block);
+                return block;
+            }
+            aux_removeFromFreeBlocks(buddy);
+            buddy->setIsFree(cookie, false);
+            held.unlock();
+            block = aux_combineBuddies(block, buddy);
         }
+    }
 
-        bool left = (((long)block - (long)base_heap_addr) / block_size) % 2 == 0;
-        auto buddy = (MallocMetadata*)(left ? ((char*)block + block_size) : ((char*)block - block_size));
-        if (!buddy->getIsFree(cookie) || buddy->getSize(cookie) != block_size)
+    /*
+     * The heap base is aligned to the max-order size (see initialize_blocks), so a block of size 2^k
+     * always sits at an address that is a multiple of 2^k and its buddy differs from it only in bit k.
+     * That makes the buddy a single XOR away, without any division or modulo on the merge path.
+     */
+    //Only a stable answer with the order's lock held: free buddies of that order can't change without it.
+    MallocMetadata* aux_getBuddy(MallocMetadata* block, size_t overwrite_size=0) {
+        size_t block_size = overwrite_size ? overwrite_size : block->getSize(cookie);
+        if (block_size == order_map[MAX_ORDER]) return nullptr; //No buddies for max-order blocks. (It's lonely at the top or something)
+
+        auto buddy = (MallocMetadata*)((uintptr_t)block ^ block_size);
+        if (!buddy->isFreeWithSize(cookie, block_size))
         {
             return nullptr; //Buddy is either allocated or split into a smaller chunk.
         }
         return buddy;
     }
+
+    /*
+     * Takes the smallest free block that can hold size bytes off its list, marked allocated, or returns nullptr.
+     * The order masks only say which lists are worth locking: one found empty under its lock was emptied by another
+     * thread meanwhile, and is skipped.
+     * With prefer_zeroed, a zeroed block of the smallest order comes first. A larger zeroed one only beats a smaller
+     * dirty one while the zero pool is on; otherwise it would mostly be fresh heap, split up just to skip a memset.
+     */
+    MallocMetadata* aux_takeFreeBlock(size_t size, bool prefer_zeroed) {
+        int order = aux_minimalOrderFor(size + sizeof(MallocMetadata));
+        if (order < 0) {
+            return nullptr;
+        }
+        if (prefer_zeroed) {
+            auto orders = zero_pool_enabled.load(std::memory_order_relaxed) ? ~0u << order : 1u << order;
+            for (auto candidates = order_masks.zeroed.load(std::memory_order_relaxed) & orders; candidates; candidates &= candidates - 1) {
+                int candidate = __builtin_ctz(candidates);
+                std::lock_guard<std::mutex> held(order_locks[candidate].lock);
+                if (auto block = zeroed_blocks[candidate]) {
+                    aux_removeFromFreeBlocks(block);
+                    block->setIsFree(cookie, false);
+                    return block;
+                }
+            }
+        }
+        for (auto candidates = order_masks.free.load(std::memory_order_relaxed) & (~0u << order); candidates; candidates &= candidates - 1) {
+            int candidate = __builtin_ctz(candidates);
+            std::lock_guard<std::mutex> held(order_locks[candidate].lock);
+            auto block = free_blocks[candidate]; //Dirty blocks first, to leave the zeroed ones to scalloc.
+            if (!block) {
+                block = zeroed_blocks[candidate] ? zeroed_blocks[candidate] : (candidate == MAX_ORDER ? released_blocks : nullptr);
+            }
+            if (block) {
+                aux_removeFromFreeBlocks(block);
+                block->setIsFree(cookie, false);
+                return block;
+            }
+        }
+        return nullptr;
+    }
+
+    //Takes a dirty free block off its list for an order that is short of zeroed blocks.
+    MallocMetadata* aux_takeBlockToZero() {
+        for (int order = 0; order < ORDER_COUNT; ++order) {
+            std::lock_guard<std::mutex> held(order_locks[order].lock);
+            if (zeroed_counts[order] < zero_pool_target && free_blocks[order]) {
+                auto block = free_blocks[order];
+                aux_removeFromFreeBlocks(block);
+                block->setIsFree(cookie, false); //Keeps it out of merges while it's cleared.
+                return block;
+            }
+        }
+        return nullptr;
+    }
+
+    /*
+     * Body of the pre-zeroing thread. It wakes up every ZERO_POOL_IDLE_MS, and if no allocator operation happened
+     * since the last wake up, clears blocks one at a time until the pool is full or the application calls in again.
+     * A block being cleared is off every list and not marked free, so it's as good as allocated meanwhile.
+     */
+    void aux_zeroPoolLoop() {
+        auto last_seen = operation_count.load();
+        while (!zero_pool_stop) {
+            {
+                std::unique_lock<std::mutex> held(zero_pool_lock);
+                zero_pool_wakeup.wait_for(held, std::chrono::milliseconds(ZERO_POOL_IDLE_MS));
+            }
+            if (operation_count.load() != last_seen) {
+                last_seen = operation_count.load();
+                continue;
+            }
+            MallocMetadata* block;
+            while (!zero_pool_stop && operation_count.load() == last_seen && (block = aux_takeBlockToZero())) {
+                auto payload = (char*)(block + 1) + MallocMetadata::linksSize();
+                std::memset(payload, 0, (char*)block + block->getSize(cookie) - payload);
+                block->setIsZeroed(cookie, true);
+                block->setIsPoolZeroed(cookie, true);
+                aux_coalesceAndFile(block);
+            }
+        }
+    }
+
+    //Lets the pre-zeroing thread see the application is busy. Costs nothing while the pool is off.
+    void aux_noteOperation() {
+        if (zero_pool_enabled.load(std::memory_order_relaxed)) {
+            operation_count.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    //The calling thread's cache, or nullptr once it has been retired.
+    ThreadCache* aux_threadCache() {
+        auto cache = &thread_caches[arena_index];
+        if (cache->state != THREAD_CACHE_ACTIVE) {
+            if (cache->state == THREAD_CACHE_RETIRED) {
+                return nullptr;
+            }
+            (void)&thread_cache_owner; //First use constructs it, which schedules its destructor for the thread's exit.
+            cache->state = THREAD_CACHE_ACTIVE;
+        }
+        return cache;
+    }
+
+    //Registers the calling thread's cache for stealing if it should be. Only called on the slow paths.
+    void aux_offerThreadCache(ThreadCache* cache) {
+        if (!cache->stealable && thread_cache_stealing.load(std::memory_order_relaxed)) {
+            aux_registerThreadCache(cache);
+        }
+    }
+
+    //Takes the busy flag of the calling thread's own cache if it is stealable. Returns whether it did.
+    static bool aux_lockThreadCache(ThreadCache* cache) {
+        if (!cache->stealable) {
+            return false;
+        }
+        while (cache->busy.exchange(true, std::memory_order_acquire)) {
+            std::this_thread::yield(); //A thief is moving blocks out; that never takes long.
+        }
+        return true;
+    }
+
+    static void aux_unlockThreadCache(ThreadCache* cache, bool locked) {
+        if (locked) {
+            cache->busy.store(false, std::memory_order_release);
+        }
+    }
+
+    //Pops a block of the given order off the calling thread's cache, refilling an empty one first. Never locks on a hit.
+    MallocMetadata* aux_takeCachedBlock(int order) {
+        auto cache = &thread_caches[arena_index];
+        if (cache->stealable || cache->counts[order] == 0) {
+            return aux_takeCachedBlockSlowly(order);
+        }
+        auto block = cache->heads[order];
+        cache->heads[order] = block->getNext(cookie);
+        --cache->counts[order];
+        block->setIsCached(cookie, false);
+        return block;
+    }
+
+    //Pushes a freed buddy block onto the calling thread's cache, flushing the cache if that takes it over the limit.
+    bool aux_cacheBlock(MallocMetadata* block) {
+        int order = order_from_size(block->getSize(cookie));
+        int limit = thread_cache_limits[order].load(std::memory_order_relaxed);
+        ThreadCache* cache;
+        if (limit <= 0 || !(cache = aux_threadCache())) {
+            return false;
+        }
+        block->setIsCached(cookie, true);
+        if (cache->stealable || cache->counts[order] >= limit) {
+            aux_cacheBlockSlowly(cache, block, order, limit);
+            return true;
+        }
+        block->setNext(cookie, cache->heads[order]);
+        cache->heads[order] = block;
+        ++cache->counts[order];
+        return true;
+    }
+
+    MallocMetadata* aux_takeCachedBlockSlowly(int order);
+    void aux_cacheBlockSlowly(ThreadCache* cache, MallocMetadata* block, int order, int limit);
+    bool aux_refillThreadCache(ThreadCache* cache, int order);
+    void aux_flushThreadCache(ThreadCache* cache, int order, int keep);
+    void aux_registerThreadCache(ThreadCache* cache);
+    bool aux_stealThreadCacheBatch(ThreadCache* cache, int order, int count);
+
+#ifdef RSEQ_CPU_CACHES
+    static_assert(sizeof(CpuCache) == 64, "The rseq sections find a CPU's cache by shifting its id by 6");
+
+    static struct rseq* aux_rseqArea() {
+        return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+    }
+
+    //glibc registers every thread with rseq when the kernel supports it; the CPU id stays negative otherwise.
+    static bool aux_rseqAvailable() {
+        return __rseq_size > 0 && (int)aux_rseqArea()->cpu_id >= 0;
+    }
+
+    /*
+     * Pops the top block of the calling CPU's stack for the order, or returns nullptr if it is empty. Labels: 3 is the
+     * critical section's descriptor, 1 its start, 2 its end, and 4 the abort handler the kernel jumps to when it
+     * interrupts the section, which starts over from 6, since the kernel clears rseq_cs on the way.
+     */
+    static MallocMetadata* aux_rseqPop(CpuCache* caches, long order) {
+        auto area = aux_rseqArea();
+        MallocMetadata* block;
+        asm volatile(
+            ".pushsection __rseq_cs, \"aw\"\n\t"
+            ".balign 32\n\t"
+            "3:\n\t"
+            ".long 0x0, 0x0\n\t"
+            ".quad 1f, (2f - 1f), 4f\n\t"
+            ".popsection\n\t"
+            "6:\n\t"
+            "leaq 3b(%%rip), %%rax\n\t"
+            "movq %%rax, %[rseq_cs]\n\t"
+            "1:\n\t"
+            "movl %[cpu_id], %%eax\n\t"
+            "shlq $6, %%rax\n\t"
+            "addq %[caches], %%rax\n\t"
+            "movq (%%rax, %[order], 8), %[block]\n\t"
+            "testq %[block], %[block]\n\t"
+            "jz 2f\n\t"
+            "movq %c[next](%[block]), %%rcx\n\t"
+            "movq %%rcx, (%%rax, %[order], 8)\n\t" //Commit.
+            "2:\n\t"
+            ".pushsection __rseq_failure, \"ax\"\n\t"
+            ".long 0x53053053\n\t" //RSEQ_SIG, which the kernel checks right before the abort handler.
+            "4:\n\t"
+            "jmp 6b\n\t"
+            ".popsection\n\t"
+            : [block] "=&r"(block), [rseq_cs] "=m"(area->rseq_cs)
+            : [cpu_id] "m"(area->cpu_id), [caches] "r"(caches), [order] "r"(order),
+              [next] "i"(sizeof(MallocMetadata))
+            : "rax", "rcx", "memory", "cc");
+        return block;
+    }
+
+    //Pushes the block onto the calling CPU's stack for the order, unless that would take it past limit blocks.
+    static bool aux_rseqPush(CpuCache* caches, long order, MallocMetadata* block, long limit) {
+        auto area = aux_rseqArea();
+        long pushed;
+        asm volatile(
+            ".pushsection __rseq_cs, \"aw\"\n\t"
+            ".balign 32\n\t"
+            "3:\n\t"
+            ".long 0x0, 0x0\n\t"
+            ".quad 1f, (2f - 1f), 4f\n\t"
+            ".popsection\n\t"
+            "6:\n\t"
+            "leaq 3b(%%rip), %%rax\n\t"
+            "movq %%rax, %[rseq_cs]\n\t"
+            "1:\n\t"
+            "xorl %k[pushed], %k[pushed]\n\t"
+            "movl %[cpu_id], %%eax\n\t"
+            "shlq $6, %%rax\n\t"
+            "addq %[caches], %%rax\n\t"
+            "movq (%%rax, %[order], 8), %%rcx\n\t"
+            "movl $1, %%edx\n\t"
+            "testq %%rcx, %%rcx\n\t"
+            "jz 5f\n\t"
+            "movq %c[depth](%%rcx), %%rdx\n\t"
+            "incq %%rdx\n\t"
+            "5:\n\t"
+            "cmpq %[limit], %%rdx\n\t"
+            "ja 2f\n\t"
+            "movq %%rcx, %c[next](%[block])\n\t"
+            "movq %%rdx, %c[depth](%[block])\n\t"
+            "movl $1, %k[pushed]\n\t"
+            "movq %[block], (%%rax, %[order], 8)\n\t" //Commit.
+            "2:\n\t"
+            ".pushsection __rseq_failure, \"ax\"\n\t"
+            ".long 0x53053053\n\t"
+            "4:\n\t"
+            "jmp 6b\n\t"
+            ".popsection\n\t"
+            : [pushed] "=&r"(pushed), [rseq_cs] "=m"(area->rseq_cs)
+            : [cpu_id] "m"(area->cpu_id), [caches] "r"(caches), [order] "r"(order), [block] "r"(block),
+              [limit] "r"(limit), [next] "i"(sizeof(MallocMetadata)),
+              [depth] "i"(sizeof(MallocMetadata) + sizeof(MallocMetadata*))
+            : "rax", "rcx", "rdx", "memory", "cc");
+        return pushed;
+    }
+#endif
+
+    static uint64_t aux_stackHead(MallocMetadata* top, uint64_t previous_head) {
+        return ((previous_head >> STACK_ADDRESS_BITS) + 1) << STACK_ADDRESS_BITS | (uintptr_t)top / BASE_ORDER_SIZE;
+    }
+
+    static MallocMetadata* aux_stackTop(uint64_t head) {
+        return (MallocMetadata*)((head & STACK_ADDRESS_MASK) * BASE_ORDER_SIZE);
+    }
+
+    //Heap memory is never unmapped, so reading the links of a top block that was popped meanwhile is harmless.
+    MallocMetadata* aux_popFreeStack(int order) {
+        auto head = free_stacks[order].load(std::memory_order_acquire);
+        while (auto top = aux_stackTop(head)) {
+            if (free_stacks[order].compare_exchange_weak(head, aux_stackHead(top->loadStackNext(), head),
+                                                         std::memory_order_acquire, std::memory_order_acquire)) {
+                top->setIsCached(cookie, false);
+                return top;
+            }
+        }
+        return nullptr;
+    }
+
+    //Pushes a freed block with no free buddy, unless its order's stack is full. Never locks.
+    bool aux_pushFreeStack(MallocMetadata* block) {
+        int limit = free_stack_limit.load(std::memory_order_relaxed);
+        if (limit <= 0 || (uintptr_t)block / BASE_ORDER_SIZE > STACK_ADDRESS_MASK || aux_getBuddy(block)) {
+            return false;
+        }
+        int order = order_from_size(block->getSize(cookie));
+        block->setIsCached(cookie, true);
+        auto head = free_stacks[order].load(std::memory_order_relaxed);
+        while (true) {
+            auto top = aux_stackTop(head);
+            size_t depth = top ? top->loadStackDepth() + 1 : 1;
+            if (depth > (size_t)limit) {
+                block->setIsCached(cookie, false);
+                return false;
+            }
+            block->setStackLinks(cookie, top, depth);
+            if (free_stacks[order].compare_exchange_weak(head, aux_stackHead(block, head),
+                                                         std::memory_order_release, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+
+    MallocMetadata* aux_takeCpuCachedBlock(int order);
+    bool aux_cpuCacheBlock(MallocMetadata* block);
+
+    void aux_freeMapping(MallocMetadata* block);
+    MallocMetadata* aux_allocateFromHeap(size_t bytes, bool prefer_zeroed);
+    int aux_takeBatch(int order, int count, MallocMetadata** list, bool split=true);
+    void aux_freeBatch(int order, MallocMetadata* list);
 public:
     BuddyAllocator(int base_order=BASE_ORDER_SIZE)
-            : base_order(base_order) {
-        free_blocks[0] = nullptr;
+            : base_order(base_order), base_shift(__builtin_ctz(base_order)) {
         order_map[0] = base_order;
         for (int i = 1; i < ORDER_COUNT; ++i) {
             order_map[i] = 2 * order_map[i-1];
+        }
+        for (int i = 0; i < ORDER_COUNT; ++i) {
             free_blocks[i] = nullptr;
+            zeroed_blocks[i] = nullptr;
+            zeroed_counts[i] = 0;
         }
     }
 
+    ~BuddyAllocator() {
+        setZeroPoolTarget(0);
+    }
+
+    //Only called by ArenaSet, before any allocation.
+    void setArena(unsigned int index, BuddyAllocator* arena_zero) {
+        arena_index = index;
+        mapping_owner = arena_zero;
+    }
+
+    //Buddy payloads sit sizeof(MallocMetadata) past an order-0 boundary, so only mapped ones are order-0 aligned.
+    static bool isMappedPayload(const void* payload) {
+        return (uintptr_t)payload % BASE_ORDER_SIZE == 0;
+    }
+
+    //Which arena a payload came from. Memory mapped blocks are all arena 0's.
+    static unsigned int arenaOf(const void* payload) {
+        if (isMappedPayload(payload)) {
+            return 0;
+        }
+        return ((const MallocMetadata*)payload - 1)->getArena();
+    }
+
     /*
-     * Seems like rand() only returns up to RAND_MAX which isn't guaranteed to utilize all of an int32's bits,
-     * so this generates a 32-bit one in a weird and hacky way. I tried ¯\_('^')_/¯
+     * A random 32-bit cookie straight from the kernel, so arenas set up within the same second still get different
+     * ones, and the application's rand() sequence is left alone. Should getrandom fail, the clock and the arena's
+     * address are mixed instead, which at least differ between arenas.
      */
     int aux_randomizeInt32() {
-        int val = 0;
+        unsigned int val;
+        if (getrandom(&val, sizeof(val), 0) != (ssize_t)sizeof(val)) {
+            val = (unsigned int)std::chrono::steady_clock::now().time_since_epoch().count()
+                  ^ (unsigned int)((uintptr_t)this >> 6) * 2654435761u;
+        }
+        return (int)val;
+    }
+
+    bool isMemoryMapped(MallocMetadata* block) {
+        return block->getSize(cookie) > order_map[MAX_ORDER];
+    }
+
+    size_t getBlockSize(const MallocMetadata* const block) {
+        return block->getSize(cookie);
+    }
+
+    bool isBlockFree(const MallocMetadata* const block) const {
+        return block->getIsFree(cookie);
+    }
+
+    void initialize_blocks() {
+        std::call_once(initialized, [this] {
+#ifdef DEBUG
+            std::cout << "Initializing buddy allocator." << std::endl;
+#endif
+
+            cookie = aux_randomizeInt32();
+            page_size = sysconf(_SC_PAGESIZE);
+
+            std::lock_guard<std::mutex> growing(growth_lock);
+            growHeap();
+        });
+    }
+
+    //Adds another extent of BLOCK_COUNT free max-order blocks to the heap. Called with growth_lock held.
+    bool growHeap() {
+        size_t length = BLOCK_COUNT * order_map[MAX_ORDER];
+        auto begin = (MallocMetadata*)aux_obtainExtentMemory(length);
+        if (!begin) {
+            return false;
+        }
+        auto end = (MallocMetadata*)((char*)begin + length);
+        if (!aux_registerExtent(begin, end)) {
+            munmap(begin, length); //Harmless on sbrk memory too: the range just stops being usable.
+            return false;
+        }
+
+        auto& stats = aux_stats(MAX_ORDER);
+        stats.free_blocks += BLOCK_COUNT;
+        stats.free_bytes += BLOCK_COUNT * (order_map[MAX_ORDER] - sizeof(MallocMetadata));
+        stats.allocated_bytes += BLOCK_COUNT * (order_map[MAX_ORDER] - sizeof(MallocMetadata));
+        stats.allocated_blocks += BLOCK_COUNT;
+
+        //Pushed from the top down, so that the free list hands out the lowest addresses first.
+        std::lock_guard<std::mutex> held(order_locks[MAX_ORDER].lock);
+        for (auto i = (long)BLOCK_COUNT - 1; i >= 0; --i) {
+            auto block = (MallocMetadata*)((char*)begin + i * order_map[MAX_ORDER]);
+            *block = MallocMetadata(order_map[MAX_ORDER], true, cookie);
+            block->setIsZeroed(cookie, true); //Fresh memory from the kernel.
+            block->setArena(arena_index);
+            aux_addToFreeBlocks(block);
+        }
+        return true;
+    }
+
+    //A peek at the free lists without taking any lock, for TEST_minimal_matching_no_split.
+    //With prefer_zeroed, zeroed blocks come first the way aux_takeFreeBlock takes them.
+    MallocMetadata* getMinimalMatchingFreeBlock(size_t size, bool prefer_zeroed=false) {
+        int order = aux_minimalOrderFor(size + sizeof(MallocMetadata));
+        if (order < 0) {
+            return nullptr;
+        }
+
+        //Free lists only ever hold free blocks, so the head of the lowest non-empty order is the answer.
+        unsigned int zeroed_candidates = order_masks.zeroed & (zero_pool_enabled ? ~0u << order : 1u << order);
+        if (prefer_zeroed && zeroed_candidates) {
+            return zeroed_blocks[__builtin_ctz(zeroed_candidates)];
+        }
+        unsigned int candidates = order_masks.free & (~0u << order);
+        if (!candidates) {
+            return nullptr;
+        }
+        order = __builtin_ctz(candidates);
+        if (free_blocks[order]) {
+            return free_blocks[order]; //Dirty blocks first, to leave the zeroed ones to scalloc.
+        }
+        return zeroed_blocks[order] ? zeroed_blocks[order] : released_blocks; //Resident blocks are preferred.
+    }
+
+    void setReleaseAdvice(int advice) {
+        release_advice = advice;
+    }
+
+    void setHugepageHeap(bool enabled) {
+        hugepage_heap = enabled;
+    }
+
+    void setMappingCacheLimits(size_t max_bytes, unsigned long decay_ms) {
+        std::lock_guard<std::mutex> held(mapping_lock);
+        mapping_cache_max_bytes = max_bytes;
+        mapping_cache_decay_ms = decay_ms;
+        aux_evictCachedMappings(mapping_cache_max_bytes, aux_nowMs());
+        aux_updateMappingDecayDue();
+    }
+
+    //Starts, retargets or (with 0) stops the pre-zeroing thread. Must not race with another call to it.
+    void setZeroPoolTarget(int blocks_per_order) {
+        if (zero_pool_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> held(zero_pool_lock);
+                zero_pool_stop = true;
+            }
+            zero_pool_wakeup.notify_one();
+            zero_pool_thread.join();
+            zero_pool_enabled = false;
+        }
+        zero_pool_target = blocks_per_order;
+        if (blocks_per_order > 0) {
+            initialize_blocks();
+            zero_pool_stop = false;
+            zero_pool_enabled = true;
+            zero_pool_thread = std::thread(&BuddyAllocator::aux_zeroPoolLoop, this);
+        }
+    }
+
+    void setThreadCacheLimit(int order, int max_blocks) {
+        thread_cache_limits[order] = max_blocks;
+    }
+
+    //Hands every block in the calling thread's cache back to the buddy heap.
+    void flushThreadCache() {
+        auto cache = &thread_caches[arena_index];
+        bool locked = aux_lockThreadCache(cache);
+        for (int order = 0; order < ORDER_COUNT; ++order) {
+            if (cache->counts[order] > 0) {
+                aux_flushThreadCache(cache, order, 0);
+            }
+        }
+        aux_unlockThreadCache(cache, locked);
+    }
+
+    //Flushes the calling thread's cache for good, as the thread exits, and takes it off stealable_caches.
+    void retireThreadCache() {
+        flushThreadCache();
+        auto cache = &thread_caches[arena_index];
+        if (cache->stealable) {
+            std::lock_guard<std::mutex> held(steal_lock);
+            (cache->prev_stealable ? cache->prev_stealable->next_stealable : stealable_caches) = cache->next_stealable;
+            if (cache->next_stealable) {
+                cache->next_stealable->prev_stealable = cache->prev_stealable;
+            }
+            cache->stealable = false;
+        }
+        cache->state = THREAD_CACHE_RETIRED;
+    }
+
+    void setThreadCacheStealing(bool enabled) {
+        thread_cache_stealing = enabled;
+    }
+
+    //Blocks per CPU for each of the orders the per-CPU caches cover, or 0 to stop caching them. Without rseq, a no-op.
+    void setCpuCacheLimit(int max_blocks) {
+#ifdef RSEQ_CPU_CACHES
+        if (max_blocks > 0 && !cpu_caches.load()) {
+            std::lock_guard<std::mutex> growing(growth_lock);
+            if (!cpu_caches.load()) {
+                //The possible CPUs, which bound the CPU ids the kernel hands out.
+                auto count = (size_t)sysconf(_SC_NPROCESSORS_CONF);
+                auto caches = mmap(nullptr, count * sizeof(CpuCache), PROT_READ | PROT_WRITE,
+                                   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+                if (caches == MAP_FAILED) {
+                    return;
+                }
+                cpu_cache_count = count;
+                cpu_caches.store((CpuCache*)caches, std::memory_order_release);
+            }
+        }
+        cpu_cache_limit = max_blocks;
+#else
+        (void)max_blocks;
+#endif
+    }
+
+    //Called by a thread that allocates from another arena, with a buddy payload of this one.
+    void queueRemoteFree(void* payload) {
+        auto block = (MallocMetadata*)payload - 1;
+        if (block->getIsFree(cookie) || block->getIsCached(cookie)) {
+#ifdef DEBUG
+            std::cout << "WARNING: Attempting to free a block that was already freed!" << std::endl;
+#endif
+            return;
+        }
+        block->setIsCached(cookie, true);
+        ++remote_free_depth; //Before the block can be drained, so the drain's decrement never takes the depth below 0.
+        auto head = remote_frees.load(std::memory_order_relaxed);
+        do {
+            block->setNext(cookie, head);
+        } while (!remote_frees.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    //Frees everything other threads queued so far, one batch per order. Safe from any thread.
+    void drainRemoteFrees() {
+        auto list = remote_frees.exchange(nullptr, std::memory_order_acquire);
+        MallocMetadata* by_order[ORDER_COUNT] = {};
+        size_t drained = 0;
+        while (list) {
+            auto block = list;
+            list = block->getNext(cookie);
+            int order = order_from_size(block->getSize(cookie));
+            block->setNext(cookie, by_order[order]);
+            by_order[order] = block;
+            ++drained;
+        }
+        remote_free_depth -= drained;
+        for (int order = 0; order < ORDER_COUNT; ++order) {
+            if (by_order[order]) {
+                aux_freeBatch(order, by_order[order]);
+            }
+        }
+    }
+
+    void setFreeStackLimit(int max_blocks) {
+        free_stack_limit = max_blocks;
+    }
+
+    //Takes each lock-free stack whole and frees its blocks. Safe from any thread.
+    void drainFreeStacks() {
+        for (int order = 0; order < ORDER_COUNT; ++order) {
+            auto head = free_stacks[order].load(std::memory_order_acquire);
+            while (aux_stackTop(head) && !free_stacks[order].compare_exchange_weak(head, aux_stackHead(nullptr, head),
+                                                                                   std::memory_order_acquire)) {
+            }
+            if (auto list = aux_stackTop(head)) {
+                aux_freeBatch(order, list);
+            }
+        }
+    }
+
+    //Hands every block in every CPU's cache back. Only while no other thread is calling into the allocator.
+    void flushCpuCaches() {
+        auto caches = cpu_caches.load();
+        for (size_t cpu = 0; caches && cpu < cpu_cache_count; ++cpu) {
+            for (int order = 0; order < CPU_CACHE_ORDERS; ++order) {
+                auto list = caches[cpu].heads[order];
+                caches[cpu].heads[order] = nullptr;
+                if (list) {
+                    aux_freeBatch(order, list);
+                }
+            }
+        }
+    }
+
+    static bool cpuCachesAvailable() {
+#ifdef RSEQ_CPU_CACHES
+        return aux_rseqAvailable();
+#else
+        return false;
+#endif
+    }
+
+    //TESTING STUFF:
+    void TEST_print_orders();
+    void TEST_print_blocks();
+    void TEST_minimal_matching_no_split();
+
+    //These take and return payload pointers, as mapped blocks' headers can only be touched under mapping_lock.
+    //A nonzero count makes allocateBlock an scalloc of count elements of size bytes each.
+    void* allocateBlock(size_t size, size_t count=0);
+    void freeBlock(void* payload);
+    void* reallocateBlock(void* payload, size_t size);
+
+    MallocMetadata* attemptInPlaceRealloc(MallocMetadata* block, size_t size);
+    void* attemptRemap(MallocMetadata* block, size_t size);
+    void aux_splitToFit(MallocMetadata *block, size_t requested_size);
+
+    //The freed upper halves can't merge with anything, as their buddies are the halves the block keeps.
+    void shrinkInPlace(MallocMetadata *block, size_t size) {
+        aux_splitToFit(block, size);
+    }
+    MallocMetadata* performMerge(MallocMetadata *block);
+
+    size_t _num_free_blocks() const;
+    size_t _num_free_bytes() const;
+    size_t _num_allocated_blocks() const;
+    size_t _num_allocated_bytes() const;
+    size_t _num_meta_data_bytes() const;
+    size_t _size_meta_data() const;
+    size_t _num_released_bytes() const;
+    size_t _num_cached_mapping_bytes() const;
+    size_t _num_zero_pool_hits() const;
+    size_t _num_zero_pool_misses() const;
+    size_t _num_hugetlb_mappings() const;
+    size_t _num_thp_mappings() const;
+    size_t _num_remote_free_blocks() const;
+    size_t _num_stolen_batches() const;
+#ifdef ADDRESS_ORDERED_LISTS
+    size_t _num_ordered_insert_steps() const;
+#endif
+
+    int aux_full_fetch_of_free_blocks(int *bytes=nullptr, int *bytesWithoutMetadata=nullptr);
+    int aux_full_fetch_of_used_blocks(int *bytes=nullptr, int *bytesWithoutMetadata=nullptr);
+    int aux_full_fetch_of_allocated_blocks();
+    int aux_full_fetch_of_metadata_bytes ();
+    int aux_full_fetch_of_free_bytes();
+    int aux_full_fetch_of_free_bytes_with_metadata();
+    int aux_full_fetch_of_used_bytes();
+    int aux_full_fetch_of_used_bytes_with_metadata();
+    int aux_full_fetch_of_allocated_bytes();
+    int aux_full_fetch_of_allocated_bytes_with_metadata();
+};
+
+MallocMetadata* BuddyAllocator::performMerge(MallocMetadata *block) {
+    auto& stats = aux_stats(block->getOrder(cookie));
+    stats.free_bytes += block->getSize(cookie) - sizeof(MallocMetadata);
+    ++stats.free_blocks;
+
+    block = aux_coalesceAndFile(block);
+    aux_releaseIfAboveWatermark();
+    return block;
+}
+
+//Called with mapping_lock held.
+void BuddyAllocator::aux_freeMapping(MallocMetadata *block) {
+    mapping_statistics.stats.allocated_bytes -= block->getSize(cookie) - sizeof(MallocMetadata);
+    --mapping_statistics.stats.allocated_blocks;
+    auto length = aux_mappingLength(block);
+    //The cache keeps its bookkeeping in the unused mapping itself, a copy of the header included.
+    auto mapping = (MallocMetadata*)((MappedBlock*)block)->payload;
+    *mapping = *block;
+    mapping->setIsFree(cookie, true);
+    aux_untrackMapping(block);
+    if (!aux_cacheMapping(mapping, length) && munmap(mapping, length) == -1) {
+    #ifdef DEBUG
+        std::cout << "munmap failed." << std::endl;
+    #endif
+    }
+}
+
+void BuddyAllocator::freeBlock(void* payload) {
+    aux_noteOperation();
+    if (isMappedPayload(payload)) {
+        std::lock_guard<std::mutex> held(mapping_lock);
+        if (auto entry = aux_findMapping(payload)) {
+            aux_freeMapping(&entry->header);
+        }
+        return;
+    }
+
+    auto block = (MallocMetadata*)payload - 1;
+    if (block->getIsFree(cookie) || block->getIsCached(cookie)) {
+#ifdef DEBUG
+        std::cout << "WARNING: Attempting to free a block that was already freed!" << std::endl;
+#endif
+        return;
+    }
+    if (!aux_cacheBlock(block) && !aux_cpuCacheBlock(block) && !aux_pushFreeStack(block)) {
+        performMerge(block);
+        mapping_owner->aux_decayCachedMappingsIfDue();
+    }
+}
+
+//Halves the block, freeing the upper halves, for as long as requested_size still fits in the lower one.
+void BuddyAllocator::aux_splitToFit(MallocMetadata *block, size_t requested_size) {
+    while (!(
+            order_from_size(block->getSize(cookie)) <= 0 //Got to minimal order, or
+            || requested_size > ((block->getSize(cookie) / 2) - sizeof(MallocMetadata)) //any smaller is too small
+    )) {
+        auto buddy = block->split(cookie);
+        auto& stats = aux_stats(buddy->getOrder(cookie));
+        ++stats.free_blocks;
+        ++stats.allocated_blocks;
+        stats.free_bytes += buddy->getSize(cookie) - sizeof(MallocMetadata);
+        stats.allocated_bytes -= sizeof(MallocMetadata);
+        std::lock_guard<std::mutex> held(order_locks[buddy->getOrder(cookie)].lock);
+        aux_addToFreeBlocks(buddy);
+    }
+}
+
+//Takes the smallest fitting free block, growing the heap if there is none, and splits it down to size.
+MallocMetadata* BuddyAllocator::aux_allocateFromHeap(size_t bytes, bool prefer_zeroed) {
+    auto block = aux_takeFreeBlock(bytes, prefer_zeroed);
+    while (!block) {
+        //Another thread may have grown the heap while this one waited for the lock.
+        std::lock_guard<std::mutex> growing(growth_lock);
+        if (!(block = aux_takeFreeBlock(bytes, prefer_zeroed)) && !growHeap()) {
+            return nullptr;
+        }
+    }
+    auto& stats = aux_stats(block->getOrder(cookie));
+    stats.free_bytes -= block->getSize(cookie) - sizeof(MallocMetadata);
+    --stats.free_blocks;
+    aux_splitToFit(block, bytes);
+    return block;
+}
+
+/*
+ * Takes up to count free blocks of exactly the given order onto the front of *list, marked cached, and returns how
+ * many it took. Blocks of the order are taken in one go under its lock; whenever that runs dry, one larger block is
+ * split (unless split is false), which also files a spare block of the order for the next round.
+ */
+int BuddyAllocator::aux_takeBatch(int order, int count, MallocMetadata** list, bool split) {
+    int taken = 0;
+    while (taken < count) {
+        {
+            std::lock_guard<std::mutex> held(order_locks[order].lock);
+            while (taken < count) {
+                auto block = free_blocks[order] ? free_blocks[order] : zeroed_blocks[order];
+                if (!block && order == MAX_ORDER) {
+                    block = released_blocks;
+                }
+                if (!block) {
+                    break;
+                }
+                aux_removeFromFreeBlocks(block);
+                block->setIsFree(cookie, false);
+                block->setIsZeroed(cookie, false);
+                block->setIsCached(cookie, true);
+                block->setNext(cookie, *list);
+                *list = block;
+                ++taken;
+                aux_stats(order).free_bytes -= order_map[order] - sizeof(MallocMetadata);
+                --aux_stats(order).free_blocks;
+            }
+        }
+        if (taken == count || !split) {
+            break;
+        }
+        auto block = aux_allocateFromHeap(order_map[order] - sizeof(MallocMetadata), false);
+        if (!block) {
+            break;
+        }
+        block->setIsZeroed(cookie, false);
+        block->setIsCached(cookie, true);
+        block->setNext(cookie, *list);
+        *list = block;
+        ++taken;
+    }
+    return taken;
+}
+
+/*
+ * Frees a list of cached blocks of the given order. Blocks whose buddy isn't free are filed together under one lock;
+ * the others are merged one by one afterwards, like any freed block.
+ */
+void BuddyAllocator::aux_freeBatch(int order, MallocMetadata* list) {
+    MallocMetadata* mergeable = nullptr;
+    {
+        std::lock_guard<std::mutex> held(order_locks[order].lock);
+        while (list) {
+            auto block = list;
+            list = block->getNext(cookie);
+            block->setIsCached(cookie, false);
+            aux_stats(order).free_bytes += order_map[order] - sizeof(MallocMetadata);
+            ++aux_stats(order).free_blocks;
+            if (aux_getBuddy(block)) {
+                block->setNext(cookie, mergeable);
+                mergeable = block;
+            }
+            else {
+                aux_addToFreeBlocks(block);
+            }
+        }
+    }
+    while (mergeable) {
+        auto block = mergeable;
+        mergeable = block->getNext(cookie);
+        aux_coalesceAndFile(block);
+    }
+    aux_releaseIfAboveWatermark();
+}
+
+//aux_takeCachedBlock for an empty or a stealable cache, whose busy flag it holds throughout.
+MallocMetadata* BuddyAllocator::aux_takeCachedBlockSlowly(int order) {
+    auto cache = &thread_caches[arena_index];
+    bool locked = aux_lockThreadCache(cache);
+    if (cache->counts[order] == 0) {
+        aux_unlockThreadCache(cache, locked);
+        if (thread_cache_limits[order].load(std::memory_order_relaxed) <= 0 || !(cache = aux_threadCache())) {
+            return nullptr;
+        }
+        aux_offerThreadCache(cache);
+        locked = aux_lockThreadCache(cache);
+        if (!aux_refillThreadCache(cache, order)) {
+            aux_unlockThreadCache(cache, locked);
+            return nullptr;
+        }
+    }
+    auto block = cache->heads[order];
+    cache->heads[order] = block->getNext(cookie);
+    --cache->counts[order];
+    aux_unlockThreadCache(cache, locked);
+    block->setIsCached(cookie, false);
+    return block;
+}
+
+//aux_cacheBlock for a full or a stealable cache, whose busy flag it holds throughout.
+void BuddyAllocator::aux_cacheBlockSlowly(ThreadCache* cache, MallocMetadata* block, int order, int limit) {
+    bool locked = aux_lockThreadCache(cache);
+    block->setNext(cookie, cache->heads[order]);
+    cache->heads[order] = block;
+    bool overflowed = ++cache->counts[order] > limit;
+    if (overflowed) {
+        aux_flushThreadCache(cache, order, limit / 2);
+    }
+    aux_unlockThreadCache(cache, locked);
+    if (overflowed) {
+        aux_offerThreadCache(cache);
+    }
+}
+
+/*
+ * Fills the calling thread's empty cache of the given order with half its limit's worth of blocks. With stealing on,
+ * free blocks of the order come first, then a sibling's cached ones, and only then a split.
+ */
+bool BuddyAllocator::aux_refillThreadCache(ThreadCache* cache, int order) {
+    int batch = (thread_cache_limits[order].load(std::memory_order_relaxed) + 1) / 2;
+    bool steal = thread_cache_stealing.load(std::memory_order_relaxed);
+    cache->counts[order] += aux_takeBatch(order, batch - cache->counts[order], &cache->heads[order], !steal);
+    if (steal && cache->counts[order] == 0 && !aux_stealThreadCacheBatch(cache, order, batch)) {
+        cache->counts[order] += aux_takeBatch(order, batch, &cache->heads[order]);
+    }
+    return cache->counts[order] > 0;
+}
+
+//Frees all but keep of the given order's cached blocks.
+void BuddyAllocator::aux_flushThreadCache(ThreadCache* cache, int order, int keep) {
+    MallocMetadata* flushed = nullptr;
+    while (cache->counts[order] > keep) {
+        auto block = cache->heads[order];
+        cache->heads[order] = block->getNext(cookie);
+        --cache->counts[order];
+        block->setNext(cookie, flushed);
+        flushed = block;
+    }
+    aux_freeBatch(order, flushed);
+}
+
+//Makes the calling thread's cache one that siblings can steal from. Only called by its owner, while not busy.
+void BuddyAllocator::aux_registerThreadCache(ThreadCache* cache) {
+    std::lock_guard<std::mutex> held(steal_lock);
+    cache->stealable = true;
+    cache->prev_stealable = nullptr;
+    cache->next_stealable = stealable_caches;
+    if (stealable_caches) {
+        stealable_caches->prev_stealable = cache;
+    }
+    stealable_caches = cache;
+}
+
+/*
+ * Moves up to count cached blocks of the given order from the first sibling cache that has some and isn't busy into
+ * the calling thread's cache, taking at most half of the sibling's. The blocks stay cached, so nothing else changes.
+ */
+bool BuddyAllocator::aux_stealThreadCacheBatch(ThreadCache* cache, int order, int count) {
+    std::lock_guard<std::mutex> held(steal_lock);
+    for (auto victim = stealable_caches; victim; victim = victim->next_stealable) {
+        if (victim == cache || victim->busy.exchange(true, std::memory_order_acquire)) {
+            continue;
+        }
+        int stolen = (victim->counts[order] + 1) / 2;
+        if (stolen > count) {
+            stolen = count;
+        }
+        for (int i = 0; i < stolen; ++i) {
+            auto block = victim->heads[order];
+            victim->heads[order] = block->getNext(cookie);
+            block->setNext(cookie, cache->heads[order]);
+            cache->heads[order] = block;
+        }
+        victim->counts[order] -= stolen;
+        victim->busy.store(false, std::memory_order_release);
+        if (stolen > 0) {
+            cache->counts[order] += stolen;
+            ++stolen_batches;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Pops a block of the given order off the calling CPU's cache. An empty cache is refilled with half its limit's worth
+ * of blocks, of which one is returned; ones that no longer fit, as other threads on the CPU refilled it meanwhile,
+ * are freed again.
+ */
+MallocMetadata* BuddyAllocator::aux_takeCpuCachedBlock(int order) {
+#ifdef RSEQ_CPU_CACHES
+    auto caches = cpu_caches.load(std::memory_order_acquire);
+    if (order >= CPU_CACHE_ORDERS || !caches || !aux_rseqAvailable()) {
+        return nullptr;
+    }
+    auto block = aux_rseqPop(caches, order);
+    if (!block) {
+        int limit = cpu_cache_limit.load(std::memory_order_relaxed);
+        if (limit <= 0 || aux_takeBatch(order, (limit + 1) / 2, &block) == 0) {
+            return nullptr;
+        }
+        MallocMetadata* overflow = nullptr;
+        for (auto spare = block->getNext(cookie); spare; ) {
+            auto next = spare->getNext(cookie);
+            if (!aux_rseqPush(caches, order, spare, limit)) {
+                spare->setNext(cookie, overflow);
+                overflow = spare;
+            }
+            spare = next;
+        }
+        if (overflow) {
+            aux_freeBatch(order, overflow);
+        }
+    }
+    block->setIsCached(cookie, false);
+    return block;
+#else
+    (void)order;
+    return nullptr;
+#endif
+}
+
+//Pushes a freed block onto the calling CPU's cache. A full cache gets half of its blocks freed along with it.
+bool BuddyAllocator::aux_cpuCacheBlock(MallocMetadata* block) {
+#ifdef RSEQ_CPU_CACHES
+    int order = order_from_size(block->getSize(cookie));
+    auto caches = cpu_caches.load(std::memory_order_acquire);
+    int limit = cpu_cache_limit.load(std::memory_order_relaxed);
+    if (order >= CPU_CACHE_ORDERS || !caches || limit <= 0 || !aux_rseqAvailable()) {
+        return false;
+    }
+    block->setIsCached(cookie, true);
+    if (aux_rseqPush(caches, order, block, limit)) {
+        return true;
+    }
+    block->setNext(cookie, nullptr);
+    for (int i = 0; i < limit / 2; ++i) {
+        auto flushed = aux_rseqPop(caches, order);
+        if (!flushed) {
+            break;
+        }
+        flushed->setNext(cookie, block);
+        block = flushed;
+    }
+    aux_freeBatch(order, block);
+    return true;
+#else
+    (void)block;
+    return false;
+#endif
+}
+
+void* BuddyAllocator::allocateBlock(size_t size, size_t count) {
+    initialize_blocks();
+    aux_noteOperation();
+
+    bool is_scalloc = count > 0;
+    size_t bytes = size;
+    if (is_scalloc && __builtin_mul_overflow(size, count, &bytes)) return nullptr;
+    if (bytes == 0 || bytes > 100000000) return nullptr;
+
+    bool hugepage = MallocMetadata::isHugepageSized(bytes, is_scalloc ? size : 0);
+    #ifdef DEBUG
+    if (hugepage) std::cout << "Allocating hugepage." << std::endl;
+    #endif
+
+    if (bytes + sizeof(MallocMetadata) >= order_map[MAX_ORDER]) { //We were instructed to only handle over 128KiB or under 128KiB-sizeof(MallocMetadata) – not anything inbetween. Still covering it just in case.
+        if (mapping_owner != this) {
+            return mapping_owner->allocateBlock(size, count);
+        }
+        auto length = aux_mappingLengthFor(bytes, hugepage);
+        bool zeroed = false;
+        void* mapping;
+        {
+            std::lock_guard<std::mutex> held(mapping_lock);
+            mapping = aux_takeCachedMapping(length, hugepage);
+            if (mapping) {
+                length = aux_cacheEntry((MallocMetadata*)mapping)->length;
+            }
+        }
+        if (!mapping) {
+            if (hugepage) {
+                mapping = aux_mapHugepages(length);
+            }
+            else {
+                mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+                if (mapping == MAP_FAILED) {
+                    mapping = nullptr;
+                }
+            }
+            zeroed = true;
+        }
+        if (!mapping) {
+            return nullptr;
+        }
+
+        {
+            std::lock_guard<std::mutex> held(mapping_lock);
+            auto block = aux_trackMapping(mapping, MallocMetadata(bytes + sizeof(MallocMetadata), false, cookie, hugepage),
+                                          length);
+            if (!block) {
+                munmap(mapping, length);
+                return nullptr;
+            }
+        }
+        ++mapping_statistics.stats.allocated_blocks;
+        mapping_statistics.stats.allocated_bytes += bytes;
+        if (is_scalloc && !zeroed) {
+            std::memset(mapping, 0, bytes);
+        }
+        return mapping;
+    }
+
+    if (remote_frees.load(std::memory_order_relaxed)) {
+        drainRemoteFrees();
+    }
+
+    if (!is_scalloc) {
+        int order = aux_minimalOrderFor(bytes + sizeof(MallocMetadata));
+        if (auto block = aux_takeCachedBlock(order)) {
+            return block + 1;
+        }
+        if (auto block = aux_takeCpuCachedBlock(order)) {
+            return block + 1;
+        }
+        if (auto block = aux_popFreeStack(order)) {
+            return block + 1;
+        }
+    }
 
-        for (int cnt = 0; cnt < 32; ++cnt) {
-            val = val | ((rand() % 2) << cnt);
-        }
+    mapping_owner->aux_decayCachedMappingsIfDue();
+    auto block = aux_allocateFromHeap(bytes, is_scalloc);
+    if (!block) {
+        return nullptr;
+    }
+    //Only blocks the pool cleared are hits, not fresh memory from the kernel; splitting keeps both flags.
+    if (is_scalloc && block->getIsPoolZeroed(cookie)) {
+        ++zero_pool_hits;
+    }
+    else if (is_scalloc && zero_pool_enabled.load(std::memory_order_relaxed)) {
+        ++zero_pool_misses;
+    }
 
-        return val;
+    //scalloc only has to clear what isn't known to be zero already:
+    if (is_scalloc) {
+        size_t dirty = block->getIsZeroed(cookie) ? MallocMetadata::linksSize() : bytes;
+        std::memset((void*)(block + 1), 0, dirty < bytes ? dirty : bytes);
     }
+    block->setIsZeroed(cookie, false);
+    return block + 1;
+}
 
-    bool isMemoryMapped(MallocMetadata* block) {
-        return block->getSize(cookie) > order_map[MAX_ORDER];
+/*
+* Grows the block by absorbing free buddies until the size fits. The block only keeps its address if every absorbed
+* buddy was on its right; otherwise it starts at the leftmost absorbed buddy, and the caller has to move the payload.
+* All the orders involved are locked (in increasing order) up front, so the buddies are either all taken or none is.
+*/
+MallocMetadata* BuddyAllocator::attemptInPlaceRealloc(MallocMetadata* block, size_t size) {
+    int order = order_from_size(block->getSize(cookie)), target_order = aux_minimalOrderFor(size + sizeof(MallocMetadata));
+    if (target_order < 0) {
+        return nullptr;
     }
 
-    size_t getBlockSize(const MallocMetadata* const block) {
-        return block->getSize(cookie);
+    std::unique_lock<std::mutex> held[ORDER_COUNT];
+    MallocMetadata* buddies[ORDER_COUNT];
+    auto curr = block;
+    for (int i = order; i < target_order; ++i) {
+        held[i] = std::unique_lock<std::mutex>(order_locks[i].lock);
+        buddies[i] = aux_getBuddy(curr, order_map[i]);
+        if (!buddies[i]) {
+            return nullptr;
+        }
+        curr = curr < buddies[i] ? curr : buddies[i];
     }
 
-    bool isBlockFree(const MallocMetadata* const block) const {
-        return block->getIsFree(cookie);
+    //The block stays allocated while it absorbs its free buddies: going through the free lists would write
+    //list links over the start of the payload that is being resized.
+    for (int i = order; i < target_order; ++i) {
+        aux_removeFromFreeBlocks(buddies[i]);
+        buddies[i]->setIsFree(cookie, false);
+        auto& stats = aux_stats(i);
+        stats.free_bytes -= order_map[i] - sizeof(MallocMetadata);
+        --stats.free_blocks;
+        stats.allocated_bytes += sizeof(MallocMetadata);
+        --stats.allocated_blocks;
     }
+    *curr = MallocMetadata(order_map[target_order > order ? target_order : order], false, cookie);
+    curr->setArena(arena_index);
+    return curr;
+}
 
-    void initialize_blocks() {
-        if (initialized) { return; }
-        initialized = true;
+/*
+ * Resizes a memory mapped block by moving page tables rather than bytes. Gives up (returning nullptr) when the new
+ * size belongs in the buddy heap or would change whether the block is hugepage backed, so the caller copies instead.
+ * Called with mapping_lock held; returns the new payload.
+ */
+void* BuddyAllocator::attemptRemap(MallocMetadata* block, size_t size) {
+    auto new_size = size + sizeof(MallocMetadata);
+    bool hugepage = MallocMetadata::isHugepageSized(size);
+    if (new_size < order_map[MAX_ORDER] || size > 100000000 || hugepage != block->getIsHugepage(cookie)) {
+        return nullptr;
+    }
 
-#ifdef DEBUG
-        std::cout << "Initializing buddy allocator." << std::endl;
-#endif
+    auto old_length = aux_mappingLength(block), new_length = aux_mappingLengthFor(size, hugepage);
+    auto payload = ((MappedBlock*)block)->payload, new_payload = payload;
+    if (new_length != old_length) {
+        new_payload = mremap(payload, old_length, new_length, MREMAP_MAYMOVE);
+        if (new_payload == MAP_FAILED) {
+            return nullptr;
+        }
+    }
 
-        srand(time(nullptr));
-        cookie = aux_randomizeInt32();
+    mapping_statistics.stats.allocated_bytes -= block->getSize(cookie) - sizeof(MallocMetadata);
+    aux_untrackMapping(block);
+    //Can't fail: the table only just gave up the old entry's slot.
+    aux_trackMapping(new_payload, MallocMetadata(new_size, false, cookie, hugepage), new_length);
+    mapping_statistics.stats.allocated_bytes += size;
+    return new_payload;
+}
 
-        free_blocks[ORDER_COUNT - 1] = base_heap_addr = (MallocMetadata*)sbrk(BLOCK_COUNT * order_map[MAX_ORDER]);
+void* BuddyAllocator::reallocateBlock(void* oldp, size_t size) {
+    aux_noteOperation();
 
-        auto first_block = free_blocks[ORDER_COUNT - 1];
-        *first_block = MallocMetadata(order_map[ORDER_COUNT - 1], true, nullptr, nullptr, cookie);
-        first_block->setNext(cookie, aux_getBlockByAddressTraversal(MAX_ORDER, 1));
-        auto last_block = aux_getBlockByAddressTraversal(MAX_ORDER, BLOCK_COUNT - 1);
-        *last_block = MallocMetadata(order_map[ORDER_COUNT - 1], true, nullptr, nullptr, cookie);
-        last_block->setPrev(cookie, aux_getBlockByAddressTraversal(MAX_ORDER, BLOCK_COUNT - 2));
+    // We were told to assume realloc would only happen between mmap-sized to mmap-sized
+    // or non-map-sized to non-mmap-sized. Handling in accordance.
 
-        for (long unsigned int i = 1; i < BLOCK_COUNT - 1; ++i) {
-            auto curr = aux_getBlockByAddressTraversal(MAX_ORDER, i);
-            *curr = MallocMetadata(order_map[ORDER_COUNT - 1], true, nullptr, nullptr, cookie);
+    size_t old_payload;
+    void* newp{nullptr};
+    bool in_place{false};
 
-            curr->setPrev(cookie, aux_getBlockByAddressTraversal(MAX_ORDER, i - 1));
-            curr->setNext(cookie, aux_getBlockByAddressTraversal(MAX_ORDER, i + 1));
+    if (isMappedPayload(oldp)) {
+        std::lock_guard<std::mutex> held(mapping_lock);
+        auto entry = aux_findMapping(oldp);
+        if (entry == nullptr) {
+            return nullptr;
+        }
+        old_payload = entry->header.getSize(cookie) - sizeof(MallocMetadata);
+        auto remapped = attemptRemap(&entry->header, size);
+        if (remapped) {
+            return remapped;
         }
-
-        free_block_count = BLOCK_COUNT;
-        free_space = BLOCK_COUNT * (order_map[MAX_ORDER] - sizeof(MallocMetadata));
-        allocated_space = free_space;
-        total_allocated_blocks = BLOCK_COUNT;
     }
+    else {
+        auto old_block = (MallocMetadata*)oldp - 1;
+        old_payload = old_block->getSize(cookie) - sizeof(MallocMetadata);
+        if (size <= old_payload) {
+            shrinkInPlace(old_block, size);
+            return oldp;
+        }
 
-    MallocMetadata* getMinimalMatchingFreeBlock(size_t size) {
-        for (int i = 0; i < ORDER_COUNT; ++i) {
-            if (order_map[i] < size + sizeof(MallocMetadata)) {
-                continue;
-            }
-
-            auto curr = free_blocks[i];
-            while (curr != nullptr) {
-                if (curr->getIsFree(cookie)) {
-                    return curr;
-                }
-                curr = curr->getNext(cookie);
-            }
+        auto absorbed = attemptInPlaceRealloc(old_block, size);
+        if (absorbed) {
+            newp = absorbed + 1;
+            in_place = true;
         }
-        return nullptr;
     }
 
-    //TESTING STUFF:
-    void TEST_print_orders();
-    void TEST_print_blocks();
-    void TEST_minimal_matching_no_split();
-
-    MallocMetadata *allocateBlock(size_t size, int count=-1);
-    MallocMetadata* attemptInPlaceRealloc(MallocMetadata* block, size_t size);
-    void setBlockFree(MallocMetadata *block, bool free_value, size_t requested_size=0);
-    MallocMetadata* performMerge(MallocMetadata *block, size_t requested_size=0);
+    if (!newp) {
+        newp = allocateBlock(size);
+        if (!newp) {
+            return nullptr;
+        }
+    }
 
-    size_t _num_free_blocks() const;
-    size_t _num_free_bytes() const;
-    size_t _num_allocated_blocks() const;
-    size_t _num_allocated_bytes() const;
-    size_t _num_meta_data_bytes() const;
-    size_t _size_meta_data() const;
+    if (newp != oldp) {
+        std::memmove(newp, oldp, old_payload < size ? old_payload : size);
+    }
+    if (!in_place) {
+        freeBlock(oldp);
+    }
 
-    int aux_full_fetch_of_free_blocks(int *bytes=nullptr, int *bytesWithoutMetadata=nullptr);
-    int aux_full_fetch_of_used_blocks(int *bytes=nullptr, int *bytesWithoutMetadata=nullptr);
-    int aux_full_fetch_of_allocated_blocks();
-    int aux_full_fetch_of_metadata_bytes ();
-    int aux_full_fetch_of_free_bytes();
-    int aux_full_fetch_of_free_bytes_with_metadata();
-    int aux_full_fetch_of_used_bytes();
-    int aux_full_fetch_of_used_bytes_with_metadata();
-    int aux_full_fetch_of_allocated_bytes();
-    int aux_full_fetch_of_allocated_bytes_with_metadata();
-};
+    return newp;
+}
 
-MallocMetadata* BuddyAllocator::performMerge(MallocMetadata *block, size_t requested_size) {
-    free_space += block->getSize(cookie) - sizeof(MallocMetadata);
-    ++free_block_count;
+/*
+ * Independent buddy allocators ("arenas"), each with its own heap, free lists, locks and counters, so threads on
+ * different arenas never touch the same structures. Threads allocate from the arena of the CPU they run on, or of
+ * a hash of their thread id, and a block is always freed back to the arena whose heap it came from, as recorded in
+ * its header. Arena 0 also keeps every memory mapped block. Only arena 0 is used until _set_arenas asks for more.
+ */
+class ArenaSet {
+private:
+    BuddyAllocator arenas[MAX_ARENAS];
+    std::atomic<int> arena_count{1};
+    std::atomic<bool> select_by_cpu{true};
+    std::atomic<bool> queue_remote_frees{false};
+
+    //pthread ids are aligned addresses, so the id's hash is mixed (by the golden ratio) before it picks an arena.
+    static size_t aux_threadKey() {
+        auto id = std::hash<std::thread::id>()(std::this_thread::get_id());
+        return (size_t)(((uint64_t)id * 0x9e3779b97f4a7c15ull) >> 32);
+    }
+public:
+    ArenaSet() {
+        for (unsigned int i = 0; i < MAX_ARENAS; ++i) {
+            arenas[i].setArena(i, &arenas[0]);
+        }
+    }
 
-    //Remove from used blocks list:
-    aux_removeFromBlocksList(block);
-    aux_addToFreeBlocks(block);
+    BuddyAllocator& arena(unsigned int index) {
+        return arenas[index];
+    }
 
-    //Merge:
-    MallocMetadata* buddy;
-    while ((buddy = aux_getBuddy(block)) != nullptr
-           && (requested_size <= 0 || requested_size > block->getSize(cookie) - sizeof(MallocMetadata))) {
-        if (!buddy->getIsFree(cookie)) {
-            break;
+    //The arena the calling thread allocates from. A thread that migrates between CPUs just moves on to another one.
+    BuddyAllocator& current() {
+        int count = arena_count.load(std::memory_order_relaxed);
+        if (count == 1) {
+            return arenas[0];
         }
-        aux_mergeStep(&block, buddy);
+        int cpu = select_by_cpu.load(std::memory_order_relaxed) ? sched_getcpu() : -1;
+        return arenas[(cpu >= 0 ? (size_t)cpu : aux_threadKey()) % count];
     }
 
-    return block;
-}
+    BuddyAllocator& owner(const void* payload) {
+        return arenas[BuddyAllocator::arenaOf(payload)];
+    }
 
-void BuddyAllocator::setBlockFree(MallocMetadata *block, bool free_value, size_t requested_size) {
-    if (free_value == block->getIsFree(cookie)) {
-#ifdef DEBUG
-        std::cout << "WARNING: Attempting to free a block that was already freed!" << std::endl;
-#endif
-        return;
+    //Arenas taken out of use keep their blocks, and still take frees of them, so they are never dropped.
+    void setArenas(int count, bool by_cpu) {
+        select_by_cpu = by_cpu;
+        arena_count = count;
     }
 
-    if (isMemoryMapped(block)) {
-        aux_removeFromBlocksList(block);
-        auto size = block->getHugepageAlignedSize(cookie);
-        allocated_space -= size - sizeof(MallocMetadata);
-        --total_allocated_blocks;
-        if (munmap(block, size) == -1) {
-        #ifdef DEBUG
-            std::cout << "munmap failed." << std::endl;
-        #endif
+    template <typename Function>
+    void forEach(Function function) {
+        for (auto& arena : arenas) {
+            function(arena);
         }
-        return;
     }
 
-    if (free_value) {
-        block = performMerge(block);
+    //Sums a statistic over all arenas; ones that never allocated contribute zeros.
+    template <typename Statistic>
+    auto total(Statistic statistic) -> decltype(std::invoke(statistic, arenas[0])) {
+        decltype(std::invoke(statistic, arenas[0])) sum = 0;
+        for (auto& arena : arenas) {
+            sum += std::invoke(statistic, arena);
+        }
+        return sum;
     }
-    else {
-        free_space -= block->getSize(cookie) - sizeof(MallocMetadata);
-        --free_block_count;
-        aux_removeFromFreeBlocks(block);
-        aux_addToBlocksList(&used_blocks, block);
 
-        //Split:
-        while (!(
-                order_from_size(block->getSize(cookie)) <= 0 //Got to minimal order, or
-                || requested_size > ((block->getSize(cookie) / 2) - sizeof(MallocMetadata)) //any smaller is too small
-        )) {
-            auto buddy = block->split(cookie);
-            ++free_block_count;
-            ++total_allocated_blocks;
-            free_space += buddy->getSize(cookie) - sizeof(MallocMetadata);
-            allocated_space -= sizeof(MallocMetadata);
-            aux_addToFreeBlocks(buddy);
+    //The pre-zeroing thread runs per arena, so only arenas that are in use at the time get one.
+    void setZeroPoolTarget(int blocks_per_order) {
+        int count = arena_count;
+        for (int i = 0; i < MAX_ARENAS; ++i) {
+            arenas[i].setZeroPoolTarget(i < count ? blocks_per_order : 0);
         }
     }
-    block->setIsFree(cookie, free_value);
-}
-
-MallocMetadata *BuddyAllocator::allocateBlock(size_t size, int count) {
-    initialize_blocks();
 
-    if (size == 0 || size > 100000000) return nullptr;
-
-    bool is_scalloc = count > 0, hugepage = MallocMetadata::isHugepageSized(count <= 0 ? size : size*count, count <= 0 ? 0 : size);
-    #ifdef DEBUG
-    if (hugepage) std::cout << "Allocating hugepage." << std::endl;
-    #endif
+    void setRemoteFreeQueues(bool enabled) {
+        queue_remote_frees = enabled;
+    }
 
-    MallocMetadata* block = nullptr;
-    if (size + sizeof(MallocMetadata) >= order_map[MAX_ORDER]) { //We were instructed to only handle over 128KiB or under 128KiB-sizeof(MallocMetadata) – not anything inbetween. Still covering it just in case.
-        block = (MallocMetadata*)mmap(nullptr, (is_scalloc ? size*count : size) + sizeof(MallocMetadata), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | (hugepage ? MAP_HUGETLB : 0), -1, 0);
-        if (block == MAP_FAILED) {
-            block = nullptr;
-        }
-        if (block) {
-            *block = !is_scalloc
-                    ? MallocMetadata(size + sizeof(MallocMetadata), false, nullptr, nullptr, cookie)
-                    : MallocMetadata(size*count + sizeof(MallocMetadata), false, nullptr, nullptr, cookie, size);
-            aux_addToBlocksList(&mmapped_blocks, block);
-            ++total_allocated_blocks;
-            allocated_space += size;
+    //Buddy blocks of another arena than the caller's go to that arena's remote free queue, when enabled.
+    void freeBlock(void* payload) {
+        auto& owner_arena = owner(payload);
+        if (queue_remote_frees.load(std::memory_order_relaxed) && !BuddyAllocator::isMappedPayload(payload)
+                && &owner_arena != &current()) {
+            owner_arena.queueRemoteFree(payload);
+            return;
         }
-    }
-    else {
-        block = getMinimalMatchingFreeBlock(size);
-        if (block)
-            setBlockFree(block, false, size);
+        owner_arena.freeBlock(payload);
     }
 
-    return block;
-}
+    void flushThreadCaches() {
+        forEach([](BuddyAllocator& arena) { arena.flushThreadCache(); });
+    }
 
-/*
-* NOTE: not actually in-place, but achieved by merging with buddies iteratively until
-* a matching size is acheived
-*/
-MallocMetadata* BuddyAllocator::attemptInPlaceRealloc(MallocMetadata* block, size_t size) {
-    if (size > aux_getMaxMergeableSize(block) - sizeof(MallocMetadata)) {
-        return nullptr;
+    void retireThreadCaches() {
+        forEach([](BuddyAllocator& arena) { arena.retireThreadCache(); });
     }
-    auto new_block = performMerge(block, size);
-    setBlockFree(new_block, false, size);
-    return new_block;
-}
+};
+
+auto allocator = ArenaSet();
+
+thread_local BuddyAllocator::ThreadCache BuddyAllocator::thread_caches[MAX_ARENAS];
+thread_local BuddyAllocator::ThreadCacheOwner BuddyAllocator::thread_cache_owner;
 
-auto allocator = BuddyAllocator();
+BuddyAllocator::ThreadCacheOwner::~ThreadCacheOwner() {
+    allocator.retireThreadCaches();
+}
 
+//The TEST_* helpers look at arena 0, the only one in use unless _set_arenas was called.
 void TEST_print_orders() {
-    allocator.TEST_print_orders();
+    allocator.arena(0).TEST_print_orders();
 }
 
 void TEST_print_blocks() {
-    allocator.TEST_print_blocks();
+    allocator.arena(0).TEST_print_blocks();
 }
 
 void TEST_several_stuff() {
-    allocator.TEST_minimal_matching_no_split();
+    allocator.arena(0).TEST_minimal_matching_no_split();
 }
 
 void* smalloc(size_t size) {
-    auto block_ptr = allocator.allocateBlock(size);
-    if (block_ptr != nullptr) {
-        block_ptr += 1;
-    }
-    return block_ptr;
+    return allocator.current().allocateBlock(size);
 }
 
 void* scalloc(size_t num, size_t size) {
-    auto addr = allocator.allocateBlock(size, num);
-    if (addr == nullptr) {
-        return nullptr;
-    }
-    ++addr;
-
-    std::memset((void*)addr, 0, num * size);
-
-    return addr;
+    if (num == 0) return nullptr; //Rather than an smalloc, which is what a zero count means to allocateBlock.
+    return allocator.current().allocateBlock(size, num); //allocateBlock already zeroed whatever wasn't zero.
 }
 
 void sfree(void* p) {
     if (p == nullptr) return;
 
-    auto pointer = (MallocMetadata*)p;
-    --pointer; //To make it point to the metadata
-
-    if (allocator.isBlockFree(pointer)) {
-        return;
-    }
-
-    allocator.setBlockFree(pointer, true);
+    allocator.freeBlock(p);
 }
 
 void *srealloc(void* oldp, size_t size) {
     if (oldp == nullptr) {
         return smalloc(size);
     }
-    auto old_block = (MallocMetadata*)oldp;
-    --old_block;
-
-    // We were told to assume realloc would only happen between mmap-sized to mmap-sized
-    // or non-map-sized to non-mmap-sized. Handling in accordance.
-
-    auto old_size = allocator.getBlockSize(old_block);
-    MallocMetadata* newp{nullptr};
-    bool in_place{false};
-
-    if (allocator.isMemoryMapped(old_block)) {
-        if (size == old_size) {
-            return oldp;
-        }
-    }
-    else {
-        if (size <= old_size - sizeof(MallocMetadata)) {
-            return oldp;
-        }
-
-        newp = allocator.attemptInPlaceRealloc(old_block, size);
-        if (newp) {
-            ++newp;
-            in_place = true;
-        }
-    }
-
-    if (!newp) {
-        newp = (MallocMetadata*)smalloc(size);
-        if (!newp) {
-            return nullptr;
-        }
-    }
-
-    std::memmove(newp, oldp, old_size);
-    if (!in_place) {
-        allocator.setBlockFree(old_block, true);
-    }
-
-    return newp;
+    return allocator.owner(oldp).reallocateBlock(oldp, size);
 }
 
 
 
 //STATISTICS FUNCTIONS:
 size_t BuddyAllocator::_num_free_blocks() const {
-    return free_block_count;
+    return aux_sumStatistic(&Statistics::free_blocks);
 }
 
 size_t BuddyAllocator::_num_free_bytes() const {
-    return free_space;
+    return aux_sumStatistic(&Statistics::free_bytes);
 }
 
 size_t BuddyAllocator::_num_allocated_blocks() const {
-    return total_allocated_blocks;
+    return aux_sumStatistic(&Statistics::allocated_blocks);
 }
 
 size_t BuddyAllocator::_num_allocated_bytes() const {
-    return allocated_space;
+    return aux_sumStatistic(&Statistics::allocated_bytes);
 }
 
 size_t BuddyAllocator::_num_meta_data_bytes() const {
-    return total_allocated_blocks * sizeof(MallocMetadata);
+    return aux_sumStatistic(&Statistics::allocated_blocks) * sizeof(MallocMetadata);
 }
 
 size_t BuddyAllocator::_size_meta_data() const {
     return sizeof(MallocMetadata);
 }
 
+size_t BuddyAllocator::_num_released_bytes() const {
+    return released_bytes;
+}
+
+size_t BuddyAllocator::_num_cached_mapping_bytes() const {
+    return cached_mapping_bytes;
+}
+
+size_t BuddyAllocator::_num_zero_pool_hits() const {
+    return zero_pool_hits;
+}
+
+size_t BuddyAllocator::_num_zero_pool_misses() const {
+    return zero_pool_misses;
+}
+
+size_t BuddyAllocator::_num_hugetlb_mappings() const {
+    return hugetlb_mappings;
+}
+
+size_t BuddyAllocator::_num_thp_mappings() const {
+    return thp_mappings;
+}
+
+size_t BuddyAllocator::_num_remote_free_blocks() const {
+    return remote_free_depth;
+}
+
+size_t BuddyAllocator::_num_stolen_batches() const {
+    return stolen_batches;
+}
+
+#ifdef ADDRESS_ORDERED_LISTS
+size_t BuddyAllocator::_num_ordered_insert_steps() const {
+    return ordered_insert_steps;
+}
+#endif
+
 
 //TESTING STUFF:
 void BuddyAllocator::TEST_minimal_matching_no_split() {
@@ -658,26 +2480,41 @@ void BuddyAllocator::TEST_print_blocks() {
     for (int i = 0; i < ORDER_COUNT; ++i) {
         std::cout << "@ @ @\nIterating over free_blocks of order " << i << " (size: " <<
                   order_map[i] << " bytes)." << std::endl;
-        auto list = free_blocks[i];
         j = 0;
-        while (list != nullptr) {
-            std::cout << "Block #" << j++ << ": addr=" << list << ", size=" << list->getSize(cookie)
-                      << ", " << (list->getIsFree(cookie) ? "" : "not ") << "free.\nBuddy is "
-                      << aux_getBuddy(list) << std::endl;
-            list = list->getNext(cookie);
+        for (auto list : {free_blocks[i], zeroed_blocks[i]}) {
+            while (list != nullptr) {
+                std::cout << "Block #" << j++ << ": addr=" << list << ", size=" << list->getSize(cookie)
+                          << ", " << (list->getIsFree(cookie) ? "" : "not ") << "free"
+                          << (list->getIsZeroed(cookie) ? ", zeroed" : "") << ".\nBuddy is "
+                          << aux_getBuddy(list) << std::endl;
+                list = list->getNext(cookie);
+            }
         }
     }
+    std::cout << "@ @ @\nIterating over released max-order blocks." << std::endl;
+    j = 0;
+    for (auto list = released_blocks; list != nullptr; list = list->getNext(cookie)) {
+        std::cout << "Block #" << j++ << ": addr=" << list << ", size=" << list->getSize(cookie) << ", released." << std::endl;
+    }
 
-    MallocMetadata* lists[] = {used_blocks, mmapped_blocks};
-    for (auto list : lists) {
-        std::cout << "\nUsed blocks, " << (list == mmapped_blocks ? "" : "non-") << "memory mapped:" << std::endl;
-        j = 0;
-        while (list != nullptr) {
-            std::cout << "Block #" << j++ << ": addr=" << list << ", size=" << list->getSize(cookie)
-                      << ", " << (list->getIsFree(cookie) ? "" : "not ") << "free.\n" << std::endl;
-            list = list->getNext(cookie);
+    std::cout << "\nUsed blocks, non-memory mapped:" << std::endl;
+    j = 0;
+    for (size_t e = 0; e < extent_count; ++e) {
+        for (auto curr = extents[e].begin; curr < extents[e].end; curr = aux_nextInHeap(curr)) {
+            if (curr->getIsFree(cookie)) continue;
+            std::cout << "Block #" << j++ << ": addr=" << curr << ", size=" << curr->getSize(cookie)
+                      << ", not free.\n" << std::endl;
         }
     }
+
+    std::cout << "\nUsed blocks, memory mapped:" << std::endl;
+    j = 0;
+    for (size_t i = 0; i < mapped_capacity; ++i) {
+        if (!mapped_blocks[i].payload) continue;
+        auto block = &mapped_blocks[i].header;
+        std::cout << "Block #" << j++ << ": addr=" << mapped_blocks[i].payload << ", size=" << block->getSize(cookie)
+                  << ", " << (block->getIsFree(cookie) ? "" : "not ") << "free.\n" << std::endl;
+    }
 #endif
 }
 
@@ -692,33 +2529,208 @@ void BuddyAllocator::TEST_print_orders() {
 
 //STATISTICS FUNCTIONS:
 size_t _num_free_blocks() {
-    return allocator._num_free_blocks();
+    return allocator.total(&BuddyAllocator::_num_free_blocks);
 }
 
 size_t _num_free_bytes() {
-    return allocator._num_free_bytes();
+    return allocator.total(&BuddyAllocator::_num_free_bytes);
 }
 
 size_t _num_allocated_blocks() {
-    return allocator._num_allocated_blocks();
+    return allocator.total(&BuddyAllocator::_num_allocated_blocks);
 }
 
 size_t _num_allocated_bytes() {
-    return allocator._num_allocated_bytes();
+    return allocator.total(&BuddyAllocator::_num_allocated_bytes);
 }
 
 size_t _num_meta_data_bytes() {
-    return allocator._num_meta_data_bytes();
+    return allocator.total(&BuddyAllocator::_num_meta_data_bytes);
 }
 
 size_t _size_meta_data() {
     return sizeof(MallocMetadata);
 }
 
+size_t _num_released_bytes() {
+    return allocator.total(&BuddyAllocator::_num_released_bytes);
+}
+
+/*
+ * Enables handing the pages of fully free max-order blocks back to the OS with the given madvise advice
+ * (MADV_DONTNEED or MADV_FREE), or disables it when passed 0. Off by default.
+ */
+void _set_free_block_release(int advice) {
+    allocator.forEach([advice](BuddyAllocator& arena) { arena.setReleaseAdvice(advice); });
+}
+
+size_t _num_cached_mapping_bytes() {
+    return allocator.total(&BuddyAllocator::_num_cached_mapping_bytes);
+}
+
+/*
+ * Caps the cache of freed mappings at max_bytes (0 disables it), and drops entries that have been cached for longer
+ * than decay_ms. Decay is applied whenever the cache is used, and on the slower small-block allocations and frees.
+ * Defaults to MAPPING_CACHE_MAX_BYTES/MAPPING_CACHE_DECAY_MS.
+ */
+void _set_mapping_cache(size_t max_bytes, unsigned long decay_ms) {
+    allocator.arena(0).setMappingCacheLimits(max_bytes, decay_ms); //Arena 0 keeps all the mappings.
+}
+
+//scalloc calls served by a block the zero pool cleared, and ones made while it was on that got some other block.
+size_t _num_zero_pool_hits() {
+    return allocator.total(&BuddyAllocator::_num_zero_pool_hits);
+}
+
+size_t _num_zero_pool_misses() {
+    return allocator.total(&BuddyAllocator::_num_zero_pool_misses);
+}
+
+/*
+ * Starts a background thread that keeps up to blocks_per_order zeroed free blocks in every order, clearing them while
+ * the application is idle, or stops it when passed 0. Off by default. Calls to it must not race with one another.
+ * Each arena in use at the time gets its own thread, so call _set_arenas first.
+ */
+void _set_zero_pool(int blocks_per_order) {
+    allocator.setZeroPoolTarget(blocks_per_order);
+}
+
+/*
+ * Makes heap extents obtained from now on hugepage backed (hugetlbfs, or transparent hugepages as a fallback) rather
+ * than taken from the program break, to cut TLB misses over the small-object heap. Off by default; enable it before
+ * the first allocation to cover the whole heap.
+ */
+void _set_hugepage_heap(bool enabled) {
+    allocator.forEach([enabled](BuddyAllocator& arena) { arena.setHugepageHeap(enabled); });
+}
+
+//Hugepage mappings (large blocks and hugepage heap extents) backed by reserved hugetlbfs pages, and ones that
+//fell back to transparent hugepages.
+size_t _num_hugetlb_mappings() {
+    return allocator.total(&BuddyAllocator::_num_hugetlb_mappings);
+}
+
+size_t _num_thp_mappings() {
+    return allocator.total(&BuddyAllocator::_num_thp_mappings);
+}
+
+/*
+ * Caches up to max_blocks freed blocks of the given order (0 to MAX_ORDER) in each thread, so that smalloc and sfree
+ * of that order mostly skip the shared free lists, or stops caching it when passed 0. Off for every order by default.
+ * Cached blocks count as allocated until they are flushed back, which happens in batches, and when the thread exits.
+ */
+void _set_thread_cache_limit(int order, int max_blocks) {
+    if (order < 0 || order > MAX_ORDER || max_blocks < 0) {
+        return;
+    }
+    allocator.forEach([order, max_blocks](BuddyAllocator& arena) { arena.setThreadCacheLimit(order, max_blocks); });
+}
+
+//Hands the calling thread's cached blocks back, e.g. before checking that the heap has coalesced.
+void _flush_thread_cache() {
+    allocator.flushThreadCaches();
+}
+
+/*
+ * Lets a thread whose cache of some order runs dry, with no free block of that order left, steal a batch of that
+ * order's blocks from another thread's cache before splitting a larger block, which helps when some threads mostly
+ * free what others allocate. Off by default. A thread's cache takes part from its first refill or flush with stealing
+ * on; from then on its fast path takes an uncontended flag.
+ */
+void _set_thread_cache_stealing(bool enabled) {
+    allocator.forEach([enabled](BuddyAllocator& arena) { arena.setThreadCacheStealing(enabled); });
+}
+
+//Batches of blocks moved from one thread's cache to another's, over all arenas.
+size_t _num_stolen_batches() {
+    return allocator.total(&BuddyAllocator::_num_stolen_batches);
+}
+
+/*
+ * Spreads small-block allocations over count (1 to MAX_ARENAS) independent buddy arenas, picked by the CPU a thread
+ * runs on, or by a hash of its thread id when by_cpu is false or the CPU can't be told. Every arena gets a heap of its
+ * own on first use. Frees always go back to the block's own arena. Only arena 0 is used by default; the statistics
+ * functions add up all the arenas.
+ */
+void _set_arenas(int count, bool by_cpu) {
+    if (count < 1 || count > MAX_ARENAS) {
+        return;
+    }
+    allocator.setArenas(count, by_cpu);
+}
+
+/*
+ * Caches up to max_blocks freed blocks of each of the orders 0 to CPU_CACHE_ORDERS - 1 per CPU, handed out and taken
+ * back through restartable sequences, or stops caching when passed 0. Off by default. Where rseq isn't available,
+ * the blocks keep going through the locked free lists. Cached blocks count as allocated until they are flushed.
+ */
+void _set_cpu_cache_limit(int max_blocks) {
+    if (max_blocks < 0) {
+        return;
+    }
+    allocator.forEach([max_blocks](BuddyAllocator& arena) { arena.setCpuCacheLimit(max_blocks); });
+}
+
+//Hands the blocks in the per-CPU caches back. Only call it while no other thread is calling into the allocator.
+void _flush_cpu_caches() {
+    allocator.forEach([](BuddyAllocator& arena) { arena.flushCpuCaches(); });
+}
+
+/*
+ * Makes threads hand blocks of other arenas than their own back through that arena's lock-free remote free queue,
+ * which the arena drains on its next allocation, rather than through its locked free lists. Only matters with more
+ * than one arena (see _set_arenas). Off by default.
+ */
+void _set_remote_free_queues(bool enabled) {
+    allocator.setRemoteFreeQueues(enabled);
+}
+
+//Blocks waiting in remote free queues, over all arenas.
+size_t _num_remote_free_blocks() {
+    return allocator.total(&BuddyAllocator::_num_remote_free_blocks);
+}
+
+//Frees whatever is waiting in the remote free queues right away, rather than on the arenas' next allocations.
+void _drain_remote_frees() {
+    allocator.forEach([](BuddyAllocator& arena) { arena.drainRemoteFrees(); });
+}
+
+/*
+ * Puts a lock-free stack of up to max_blocks blocks in front of each order's free list: blocks freed with nothing to
+ * merge with are pushed there, and allocations of exactly their order pop them, without taking any lock. Passing 0
+ * stops pushing. Off by default. Stacked blocks count as allocated until popped or drained.
+ */
+void _set_lock_free_stacks(int max_blocks) {
+    if (max_blocks < 0) {
+        return;
+    }
+    allocator.forEach([max_blocks](BuddyAllocator& arena) { arena.setFreeStackLimit(max_blocks); });
+}
+
+//Frees every block on the lock-free stacks right away.
+void _drain_lock_free_stacks() {
+    allocator.forEach([](BuddyAllocator& arena) { arena.drainFreeStacks(); });
+}
+
+//Whether the calling thread can use the per-CPU caches, i.e. is registered with rseq.
+bool _cpu_caches_available() {
+    return BuddyAllocator::cpuCachesAvailable();
+}
+
+#ifdef ADDRESS_ORDERED_LISTS
+size_t _num_ordered_insert_steps() {
+    return allocator.total(&BuddyAllocator::_num_ordered_insert_steps);
+}
+#endif
+
 int BuddyAllocator::aux_full_fetch_of_free_blocks(int *bytes, int *bytesWithoutMetadata) {
     int total_bytes = 0, total_bytes_without_metadata = 0;
     int cnt = 0;
-    for (auto list : free_blocks) {
+    MallocMetadata* lists[2 * ORDER_COUNT + 1];
+    std::memcpy(lists, free_blocks, sizeof(free_blocks));
+    std::memcpy(lists + ORDER_COUNT, zeroed_blocks, sizeof(zeroed_blocks));
+    lists[2 * ORDER_COUNT] = released_blocks;
+    for (auto list : lists) {
         while (list) {
             ++cnt;
             total_bytes += list->getSize(cookie);
@@ -736,17 +2748,22 @@ int BuddyAllocator::aux_full_fetch_of_free_blocks(int *bytes, int *bytesWithoutM
 int BuddyAllocator::aux_full_fetch_of_used_blocks(int *bytes, int *bytesWithoutMetadata) {
     int total_bytes = 0, total_bytes_without_metadata = 0;
     int cnt = 0;
-    MallocMetadata* lists[] = {used_blocks, mmapped_blocks};
-    for (auto list : lists) {
-        auto curr = list;
-        while (curr) {
+    for (size_t e = 0; e < extent_count; ++e) {
+        for (auto curr = extents[e].begin; curr < extents[e].end; curr = aux_nextInHeap(curr)) {
+            if (curr->getIsFree(cookie)) continue;
             total_bytes += curr->getSize(cookie);
             total_bytes_without_metadata += curr->getSize(cookie) - sizeof(MallocMetadata);
             ++cnt;
-            curr = curr->getNext(cookie);
         }
     }
 
+    for (size_t i = 0; i < mapped_capacity; ++i) {
+        if (!mapped_blocks[i].payload) continue;
+        total_bytes += mapped_blocks[i].header.getSize(cookie);
+        total_bytes_without_metadata += mapped_blocks[i].header.getSize(cookie) - sizeof(MallocMetadata);
+        ++cnt;
+    }
+
     if (bytes) *bytes = total_bytes;
     if (bytesWithoutMetadata) *bytesWithoutMetadata = total_bytes_without_metadata;
 
@@ -794,32 +2811,32 @@ int BuddyAllocator::aux_full_fetch_of_allocated_bytes() {
 }
 
 int FULL_free_blocks_count() {
-    return allocator.aux_full_fetch_of_free_blocks();
+    return allocator.total([](BuddyAllocator& arena) { return arena.aux_full_fetch_of_free_blocks(); });
 }
 int FULL_free_blocks_bytes() {
-    return allocator.aux_full_fetch_of_free_bytes();
+    return allocator.total(&BuddyAllocator::aux_full_fetch_of_free_bytes);
 }
 int FULL_used_blocks_count() {
-    return allocator.aux_full_fetch_of_used_blocks();
+    return allocator.total([](BuddyAllocator& arena) { return arena.aux_full_fetch_of_used_blocks(); });
 }
 int FULL_used_blocks_bytes() {
-    return allocator.aux_full_fetch_of_used_bytes();
+    return allocator.total(&BuddyAllocator::aux_full_fetch_of_used_bytes);
 }
 int FULL_allocated_blocks_count() {
-    return allocator.aux_full_fetch_of_allocated_blocks();
+    return allocator.total(&BuddyAllocator::aux_full_fetch_of_allocated_blocks);
 }
 int FULL_allocated_blocks_bytes() {
-    return allocator.aux_full_fetch_of_allocated_bytes();
+    return allocator.total(&BuddyAllocator::aux_full_fetch_of_allocated_bytes);
 }
 int FULL_metadata_bytes () {
-    return allocator.aux_full_fetch_of_metadata_bytes();
+    return allocator.total(&BuddyAllocator::aux_full_fetch_of_metadata_bytes);
 }
 int FULL_free_blocks_bytes_with_metadata() {
-    return allocator.aux_full_fetch_of_free_bytes_with_metadata();
+    return allocator.total(&BuddyAllocator::aux_full_fetch_of_free_bytes_with_metadata);
 }
 int FULL_used_blocks_bytes_with_metadata() {
-    return allocator.aux_full_fetch_of_used_bytes_with_metadata();
+    return allocator.total(&BuddyAllocator::aux_full_fetch_of_used_bytes_with_metadata);
 }
 int FULL_allocated_blocks_bytes_with_metadata() {
-    return allocator.aux_full_fetch_of_allocated_bytes_with_metadata();
+    return allocator.total(&BuddyAllocator::aux_full_fetch_of_allocated_bytes_with_metadata);
 }
\ No newline at end of file